@@ -0,0 +1,496 @@
+/* Copyright 2015 Miro Hrončok <miro@hroncok.cz>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+// stlcut benchmark
+// generates parametric meshes of given sizes as binary STL files, cuts each of them by
+// stlcut --stats at z = 0 and reports the time of every phase and the throughput
+//
+// build: g++ -O2 -std=c++11 -o stlcut_bench bench/stlcut_bench.cpp
+// usage: stlcut_bench [--stlcut ./stlcut] [--shapes sphere,torus,boxes,gyroid]
+//                     [--sizes 10000,100000,1000000,10000000] [--threads N] [--keep]
+//
+// sphere: one loop, torus: cut lengthwise, two loops with a hole,
+// boxes: grid of thin-walled boxes, two loops each, gyroid: thin gyroid sheet clipped
+// by a box, many loops with holes
+// sizes are approximate facet counts, up to 100M works but needs 5 GB of disk per file
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct vertex {
+  float x;
+  float y;
+  float z;
+  vertex() : x(0), y(0), z(0) {}
+  vertex(float x, float y, float z) : x(x), y(y), z(z) {}
+};
+
+// binary STL file written facet by facet, the facet count is backpatched when closed
+// without a file the facets are only counted
+struct stl_output {
+  FILE* fp;
+  unsigned facets;
+  
+  stl_output() : fp(NULL), facets(0) {}
+  
+  bool open(const char* name) {
+    fp = fopen(name, "wb");
+    if (!fp) return false;
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+    facets = 0;
+    char header[84];
+    memset(header, 0, sizeof(header));
+    strcpy(header, "stlcut_bench");
+    fwrite(header, sizeof(header), 1, fp);
+    return true;
+  }
+  
+  void facet(vertex a, vertex b, vertex c) {
+    float record[12] = { 0, 0, 0, a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z };
+    char extra[2] = { 0, 0 };
+    facets++;
+    if (!fp) return;
+    fwrite(record, sizeof(record), 1, fp);
+    fwrite(extra, sizeof(extra), 1, fp);
+  }
+  
+  // two facets of a quad given counterclockwise
+  void quad(vertex a, vertex b, vertex c, vertex d) {
+    facet(a, b, c);
+    facet(a, c, d);
+  }
+  
+  bool close() {
+    fseek(fp, 80, SEEK_SET);
+    fwrite(&facets, 4, 1, fp);
+    bool ok = !ferror(fp);
+    if (fclose(fp) != 0) ok = false;
+    return ok;
+  }
+};
+
+// UV sphere of radius 10, slightly shifted so no vertex lies on the cut plane
+// the poles are single vertices with a fan of facets around each, so the mesh is closed
+void sphere(stl_output &out, long size) {
+  int rings = std::max(3, (int)sqrt(size / 4.0));
+  int segments = 2*rings;
+  const vertex north(0, 0, 10.01), south(0, 0, -9.99);
+  std::vector<vertex> previous, current;
+  for (int i = 1; i < rings; i++) {
+    current.clear();
+    double theta = M_PI * i / rings;
+    for (int j = 0; j < segments; j++) {
+      double phi = 2 * M_PI * j / segments;
+      current.push_back(vertex(10 * sin(theta) * cos(phi), 10 * sin(theta) * sin(phi), 10 * cos(theta) + 0.01));
+    }
+    for (int j = 0; j < segments; j++) {
+      int k = (j + 1) % segments;
+      if (i > 1) out.facet(previous[j], current[j], previous[k]);
+      out.facet(current[j], current[k], i > 1 ? previous[k] : north);
+    }
+    previous.swap(current);
+  }
+  for (int j = 0; j < segments; j++)
+    out.facet(previous[j], south, previous[(j + 1) % segments]);
+}
+
+// torus around the x axis, so the z = 0 plane cuts it lengthwise into two rings
+void torus(stl_output &out, long size) {
+  int minor = std::max(3, (int)sqrt(size / 8.0));
+  int major = 4*minor;
+  const double R = 10, r = 3;
+  std::vector<vertex> grid((size_t)major * minor);
+  for (int i = 0; i < major; i++) {
+    double u = 2 * M_PI * i / major;
+    for (int j = 0; j < minor; j++) {
+      double v = 2 * M_PI * (j + 0.5) / minor;
+      double w = R + r * cos(v);
+      grid[(size_t)i*minor + j] = vertex(r * sin(v), w * cos(u), w * sin(u));
+    }
+  }
+  for (int i = 0; i < major; i++) {
+    int i1 = (i + 1) % major;
+    for (int j = 0; j < minor; j++) {
+      int j1 = (j + 1) % minor;
+      out.quad(grid[(size_t)i*minor + j], grid[(size_t)i1*minor + j],
+               grid[(size_t)i1*minor + j1], grid[(size_t)i*minor + j1]);
+    }
+  }
+}
+
+// axis aligned box with every side split to n x n quads, outwards or inwards
+void box(stl_output &out, vertex low, vertex high, int n, bool inwards) {
+  double lo[3] = { low.x, low.y, low.z };
+  double hi[3] = { high.x, high.y, high.z };
+  for (int axis = 0; axis < 3; axis++) {
+    int u = (axis + 1) % 3, v = (axis + 2) % 3;
+    for (int side = 0; side < 2; side++) {
+      for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+          vertex corners[4];
+          int steps[4][2] = { {i, j}, {i+1, j}, {i+1, j+1}, {i, j+1} };
+          for (int k = 0; k < 4; k++) {
+            double p[3];
+            p[axis] = side ? hi[axis] : lo[axis];
+            p[u] = lo[u] + (hi[u] - lo[u]) * steps[k][0] / n;
+            p[v] = lo[v] + (hi[v] - lo[v]) * steps[k][1] / n;
+            corners[k] = vertex(p[0], p[1], p[2]);
+          }
+          // counterclockwise seen from outside for the high side
+          if (side == inwards) out.quad(corners[0], corners[3], corners[2], corners[1]);
+          else out.quad(corners[0], corners[1], corners[2], corners[3]);
+        }
+      }
+    }
+  }
+}
+
+// grid of hollow boxes with thin walls
+void boxes(stl_output &out, long size) {
+  int count = std::max(1, (int)sqrt(size / 10000.0));
+  int n = std::max(1, (int)sqrt(size / (24.0 * count * count)));
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < count; j++) {
+      float x = 3 * i, y = 3 * j;
+      box(out, vertex(x, y, -1.03), vertex(x + 2, y + 2, 0.97), n, false);
+      box(out, vertex(x + 0.1, y + 0.1, -0.93), vertex(x + 1.9, y + 1.9, 0.87), n, true);
+    }
+  }
+}
+
+// gyroid sheet |g| < thickness clipped by a box, polygonized by marching tetrahedra
+// vertices on grid edges are interpolated in canonical order, so shared vertices are exact
+double gyroid_field(double x, double y, double z) {
+  double g = sin(x) * cos(y) + sin(y) * cos(z) + sin(z) * cos(x);
+  double sheet = fabs(g) - 0.3;
+  double clip = std::max(std::max(fabs(x), fabs(y)), fabs(z - 0.01)) - M_PI * 4 + 0.2;
+  return std::max(sheet, clip);
+}
+
+struct gyroid_grid {
+  int n;
+  double step;
+  double origin;
+  
+  vertex point(int i, int j, int k) const {
+    return vertex(origin + i*step, origin + j*step, origin + k*step);
+  }
+  
+  double value(int i, int j, int k) const {
+    vertex p = point(i, j, k);
+    return gyroid_field(p.x, p.y, p.z);
+  }
+};
+
+// zero crossing on the edge between grid points a and b, a being the lower index
+vertex crossing(vertex a, double fa, vertex b, double fb) {
+  double t = fa / (fa - fb);
+  return vertex(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+}
+
+void tetrahedron(stl_output &out, const vertex p[4], const double f[4], const long id[4]) {
+  int inside[4], outside[4], ins = 0, outs = 0;
+  for (int i = 0; i < 4; i++) {
+    if (f[i] < 0) inside[ins++] = i;
+    else outside[outs++] = i;
+  }
+  if (ins == 0 || ins == 4) return;
+  
+  // crossing point of an edge, always computed from the lower grid index
+  vertex c[4][4];
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      if ((f[i] < 0) == (f[j] < 0)) continue;
+      c[i][j] = id[i] < id[j] ? crossing(p[i], f[i], p[j], f[j]) : crossing(p[j], f[j], p[i], f[i]);
+    }
+  }
+  
+  // orientation: the normal points from inside to outside
+  std::vector<vertex> polygon;
+  if (ins == 1) {
+    int a = inside[0];
+    for (int k = 0; k < 3; k++) polygon.push_back(c[a][outside[k]]);
+  } else if (ins == 3) {
+    int a = outside[0];
+    for (int k = 0; k < 3; k++) polygon.push_back(c[inside[k]][a]);
+  } else {
+    polygon.push_back(c[inside[0]][outside[0]]);
+    polygon.push_back(c[inside[0]][outside[1]]);
+    polygon.push_back(c[inside[1]][outside[1]]);
+    polygon.push_back(c[inside[1]][outside[0]]);
+  }
+  
+  // flip when needed, judged by the direction towards the outside
+  vertex in(0, 0, 0), outv(0, 0, 0);
+  for (int i = 0; i < ins; i++) { in.x += p[inside[i]].x / ins; in.y += p[inside[i]].y / ins; in.z += p[inside[i]].z / ins; }
+  for (int i = 0; i < outs; i++) { outv.x += p[outside[i]].x / outs; outv.y += p[outside[i]].y / outs; outv.z += p[outside[i]].z / outs; }
+  vertex a = polygon[0], b = polygon[1], d = polygon[2];
+  double ux = b.x - a.x, uy = b.y - a.y, uz = b.z - a.z;
+  double vx = d.x - a.x, vy = d.y - a.y, vz = d.z - a.z;
+  double nx = uy*vz - uz*vy, ny = uz*vx - ux*vz, nz = ux*vy - uy*vx;
+  bool flip = nx*(outv.x - in.x) + ny*(outv.y - in.y) + nz*(outv.z - in.z) < 0;
+  
+  if (polygon.size() == 3) {
+    if (flip) out.facet(polygon[0], polygon[2], polygon[1]);
+    else out.facet(polygon[0], polygon[1], polygon[2]);
+  } else {
+    if (flip) out.quad(polygon[0], polygon[3], polygon[2], polygon[1]);
+    else out.quad(polygon[0], polygon[1], polygon[2], polygon[3]);
+  }
+}
+
+// polygonizes the sheet on a grid of n cubes along every side
+void gyroid_sheet(stl_output &out, int n_cubes) {
+  gyroid_grid grid;
+  grid.n = n_cubes;
+  grid.origin = -M_PI * 4;
+  grid.step = M_PI * 8 / grid.n;
+  int n = grid.n + 1;
+  
+  // cube split to 6 tetrahedra along the main diagonal
+  static const int tetrahedra[6][4] = { {0,1,3,7}, {0,3,2,7}, {0,2,6,7}, {0,6,4,7}, {0,4,5,7}, {0,5,1,7} };
+  std::vector<double> lower((size_t)n*n), upper((size_t)n*n);
+  for (int j = 0; j < n; j++)
+    for (int i = 0; i < n; i++)
+      lower[(size_t)j*n + i] = grid.value(i, j, 0);
+  for (int k = 0; k < grid.n; k++) {
+    for (int j = 0; j < n; j++)
+      for (int i = 0; i < n; i++)
+        upper[(size_t)j*n + i] = grid.value(i, j, k+1);
+    for (int j = 0; j < grid.n; j++) {
+      for (int i = 0; i < grid.n; i++) {
+        vertex p[8];
+        double f[8];
+        long id[8];
+        for (int c = 0; c < 8; c++) {
+          int ci = i + (c & 1), cj = j + (c >> 1 & 1), ck = k + (c >> 2 & 1);
+          p[c] = grid.point(ci, cj, ck);
+          f[c] = (c >> 2 & 1 ? upper : lower)[(size_t)cj*n + ci];
+          id[c] = ((long)ck*n + cj)*n + ci;
+        }
+        for (int t = 0; t < 6; t++) {
+          vertex tp[4];
+          double tf[4];
+          long tid[4];
+          for (int v = 0; v < 4; v++) {
+            tp[v] = p[tetrahedra[t][v]];
+            tf[v] = f[tetrahedra[t][v]];
+            tid[v] = id[tetrahedra[t][v]];
+          }
+          tetrahedron(out, tp, tf, tid);
+        }
+      }
+    }
+    lower.swap(upper);
+  }
+}
+
+// number of facets of the sheet on a grid of n cubes
+long gyroid_facets(int n) {
+  stl_output counter;
+  gyroid_sheet(counter, n);
+  return counter.facets;
+}
+
+// the facet count scales with the square of the resolution only once the grid resolves the sheet
+// and it jumps where the grid is commensurate with the period of the gyroid, so the resolution
+// is searched by counting, in damped steps and then among the neighbours of the closest one
+void gyroid(stl_output &out, long size) {
+  int n = std::max(8, (int)sqrt(size / 214.0));
+  long facets = gyroid_facets(n);
+  int best = n;
+  long best_error = labs(facets - size);
+  for (int pass = 0; pass < 6 && best_error > size / 50; pass++) {
+    int next = (int)lround(n * sqrt((double)size / std::max(1L, facets)));
+    next = std::max(8, std::min(std::max(next, n * 3 / 4), n * 3 / 2));
+    if (next == n) break;
+    n = next;
+    facets = gyroid_facets(n);
+    if (labs(facets - size) < best_error) {
+      best = n;
+      best_error = labs(facets - size);
+    }
+  }
+  for (int k = best - 2; k <= best + 2 && best_error > size / 50; k++) {
+    if (k < 8 || k == best) continue;
+    facets = gyroid_facets(k);
+    if (labs(facets - size) < best_error) {
+      best = k;
+      best_error = labs(facets - size);
+    }
+  }
+  gyroid_sheet(out, best);
+}
+
+typedef void (*generator)(stl_output &out, long size);
+
+struct shape {
+  const char* name;
+  generator generate;
+};
+
+static const shape shapes[] = {
+  { "sphere", sphere },
+  { "torus", torus },
+  { "boxes", boxes },
+  { "gyroid", gyroid },
+};
+
+// value of a number after "key": in the stlcut --stats output, searching from given position
+double json_number(const std::string &json, const std::string &key, size_t from = 0) {
+  size_t i = json.find("\"" + key + "\":", from);
+  if (i == std::string::npos) return 0;
+  return atof(json.c_str() + i + key.size() + 3);
+}
+
+// wall time of the phase in the stlcut --stats output
+double phase_time(const std::string &json, const char* phase) {
+  size_t i = json.find(std::string("\"name\": \"") + phase + "\"");
+  if (i == std::string::npos) return 0;
+  return json_number(json, "wall_s", i);
+}
+
+// wall time of all phases in the stlcut --stats output, the ones without a column too
+double total_time(const std::string &json) {
+  double total = 0;
+  for (size_t i = json.find("\"wall_s\":"); i != std::string::npos; i = json.find("\"wall_s\":", i + 1))
+    total += json_number(json, "wall_s", i);
+  return total;
+}
+
+// parses comma separated list
+std::vector<std::string> split(const char* text) {
+  std::vector<std::string> items;
+  std::string item;
+  for (const char* c = text; ; c++) {
+    if (*c == ',' || *c == '\0') {
+      if (!item.empty()) items.push_back(item);
+      item.clear();
+      if (*c == '\0') break;
+    } else {
+      item += *c;
+    }
+  }
+  return items;
+}
+
+int main(int argc, char **argv) {
+  std::string stlcut = "./stlcut";
+  std::vector<std::string> names = split("sphere,torus,boxes,gyroid");
+  std::vector<std::string> sizes = split("10000,100000,1000000,10000000");
+  std::string threads;
+  bool keep = false;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--stlcut") && i+1 < argc) {
+      stlcut = argv[++i];
+    } else if (!strcmp(argv[i], "--shapes") && i+1 < argc) {
+      names = split(argv[++i]);
+    } else if (!strcmp(argv[i], "--sizes") && i+1 < argc) {
+      sizes = split(argv[++i]);
+    } else if (!strcmp(argv[i], "--threads") && i+1 < argc) {
+      threads = std::string(" --threads ") + argv[++i];
+    } else if (!strcmp(argv[i], "--keep")) {
+      keep = true;
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--stlcut ./stlcut] [--shapes sphere,torus,boxes,gyroid]"
+                << " [--sizes 10000,...] [--threads N] [--keep]" << std::endl;
+      return 1;
+    }
+  }
+  if (stlcut.find('/') != std::string::npos && stlcut[0] != '/') {
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd))) stlcut = std::string(cwd) + "/" + stlcut;
+  }
+  
+  char dir[] = "/tmp/stlcut_bench.XXXXXX";
+  if (!mkdtemp(dir)) {
+    std::cerr << "Cannot create a temporary directory" << std::endl;
+    return 1;
+  }
+  
+  static const char* phases[] = { "load", "index", "separate", "border", "stitch", "triangulate", "repair",
+                                  "write" };
+  const size_t phase_count = sizeof(phases) / sizeof(phases[0]);
+  printf("%-8s %10s %8s %6s", "shape", "facets", "border", "loops");
+  for (size_t p = 0; p < phase_count; p++) printf(" %11s", phases[p]);
+  printf(" %12s %14s %10s\n", "facets/s", "border edge/s", "total s");
+  
+  int status = 0;
+  for (size_t n = 0; n < names.size(); n++) {
+    const shape* s = NULL;
+    for (size_t k = 0; k < sizeof(shapes) / sizeof(shapes[0]); k++)
+      if (names[n] == shapes[k].name) s = &shapes[k];
+    if (!s) {
+      std::cerr << "Unknown shape " << names[n] << std::endl;
+      return 1;
+    }
+    for (size_t z = 0; z < sizes.size(); z++) {
+      std::string file = std::string(dir) + "/" + s->name + "_" + sizes[z] + ".stl";
+      stl_output out;
+      if (!out.open(file.c_str())) {
+        std::cerr << "Cannot write " << file << std::endl;
+        return 1;
+      }
+      s->generate(out, atol(sizes[z].c_str()));
+      if (!out.close()) {
+        std::cerr << "Cannot write " << file << std::endl;
+        return 1;
+      }
+      
+      // outputs go to the temporary directory too
+      std::string command = std::string("cd ") + dir + " && " + stlcut + " --stats" + threads + " " + file;
+      FILE* pipe = popen(command.c_str(), "r");
+      std::string json;
+      char buffer[4096];
+      size_t read;
+      while (pipe && (read = fread(buffer, 1, sizeof(buffer), pipe)) > 0) json.append(buffer, read);
+      if (!pipe || pclose(pipe) != 0 || json.empty()) {
+        std::cerr << "stlcut failed on " << file << std::endl;
+        status = 1;
+        continue;
+      }
+      
+      double facets = json_number(json, "input_facets");
+      double border = json_number(json, "border_edges");
+      printf("%-8s %10.0f %8.0f %6.0f", s->name, facets, border, json_number(json, "loops"));
+      for (size_t p = 0; p < phase_count; p++)
+        printf(" %11.6f", phase_time(json, phases[p]));
+      double total = total_time(json);
+      double separate = phase_time(json, "separate");
+      double cap = phase_time(json, "border") + phase_time(json, "stitch") + phase_time(json, "triangulate");
+      printf(" %12.4g %14.4g %10.4f\n", separate > 0 ? facets / separate : 0, cap > 0 ? border / cap : 0, total);
+      fflush(stdout);
+      
+      if (!keep) {
+        unlink(file.c_str());
+        unlink((std::string(dir) + "/upper.stl").c_str());
+        unlink((std::string(dir) + "/lower.stl").c_str());
+      }
+    }
+  }
+  if (!keep) rmdir(dir);
+  else std::cerr << "Meshes and cuts kept in " << dir << std::endl;
+  return status;
+}
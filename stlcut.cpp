@@ -16,12 +16,45 @@
  * MA 02110-1301, USA.
  */
 #include <iostream>
-#include <deque>
 #include <vector>
+#include <string>
 #include <set>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <new>
 #include <math.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <admesh/stl.h>
 #include <poly2tri/poly2tri.h>
+#include "stlcut.h"
+
+// number of facets read at once in streaming mode
+#define STREAM_CHUNK_FACETS 65536
+
+// minimal number of facets worth a separate thread
+#define THREAD_MIN_FACETS 16384
+
+// minimal number of cap points worth a separate thread
+#define CAP_THREAD_MIN_POINTS 4096
+
+// minimal size of ASCII STL text worth a separate parsing thread
+#define ASCII_THREAD_MIN_SIZE (1 << 22)
+
+// size of the memory chunks of the cap arenas
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+// stdio buffer size of the output files
+#define WRITER_BUFFER_SIZE (1 << 20)
 
 // vertex position related to the plane
 enum stl_position { above, on, below };
@@ -138,19 +171,271 @@ struct stl_vertex_pair {
     this->y=y;
   }
   
-  // this is needed by set
-  bool operator<(const stl_vertex_pair& other) const  {
-    if (x.x == other.x.x) {
-      if (x.y == other.x.y) {
-        if (x.z == other.x.z) {
-          if (y.x == other.y.x) {
-            if (y.y == other.y.y) {
-              return y.z < other.y.z;
-            } else return y.y < other.y.y;
-          } else return y.x < other.y.x;
-        } else return x.z < other.x.z;
-      } else return x.y < other.x.y;
-    } else return x.x < other.x.x;
+  // this is needed by the hash tables, vertices are compared bit by bit
+  bool operator==(const stl_vertex_pair& other) const {
+    return !memcmp(this, &other, sizeof(stl_vertex_pair));
+  }
+};
+
+// hash of the bit patterns of both vertices
+struct stl_vertex_pair_hash {
+  size_t operator()(const stl_vertex_pair& pair) const {
+    unsigned bits[6];
+    memcpy(bits, &pair, sizeof(bits));
+    size_t hash = 0;
+    for (size_t i = 0; i < 6; i++)
+      hash = (hash ^ bits[i]) * 0x100000001b3ULL;
+    return hash ^ (hash >> 29);
+  }
+};
+
+// open addressing hash table of ids into an array of the caller, like the table of index_facets()
+// a lookup walks the slots from first() with next() until the id with the key or an empty slot,
+// the slots keep their memory when the table is cleared
+struct stl_id_table {
+  std::vector<int> slots; // -1 is empty
+  size_t mask;
+  int shift;
+  
+  stl_id_table() {
+    clear(0);
+  }
+  
+  // empties the table for up to count ids, at most half of the slots get used
+  void clear(size_t count) {
+    size_t size = 2;
+    shift = 63;
+    while (size < 2 * count) {
+      size <<= 1;
+      shift--;
+    }
+    slots.assign(size, -1);
+    mask = size - 1;
+  }
+  
+  // the high bits of the product depend on all bits of the hash,
+  // keys with the low bits all zero like round coordinates don't pile up
+  size_t first(size_t hash) const {
+    return (size_t)(((unsigned long long)hash * 0x9e3779b97f4a7c15ULL) >> shift);
+  }
+  
+  size_t next(size_t slot) const {
+    return (slot + 1) & mask;
+  }
+  
+  // true if one more id of the count there are would take more than half of the slots
+  bool full(size_t count) const {
+    return 2 * (count + 1) > slots.size();
+  }
+  
+  // empties the slot, the ids after it move back so no lookup stops short of them
+  // hash(id) gives the hash the id was put in with
+  template <class id_hash>
+  void erase(size_t slot, const id_hash &hash) {
+    size_t hole = slot;
+    for (size_t i = next(slot); slots[i] >= 0; i = next(i)) {
+      size_t home = first(hash(slots[i]));
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+        slots[hole] = slots[i];
+        hole = i;
+      }
+    }
+    slots[hole] = -1;
+  }
+};
+
+// lexicographic vertex order
+bool vertex_less(stl_vertex a, stl_vertex b) {
+  if (a.x != b.x) return a.x < b.x;
+  if (a.y != b.y) return a.y < b.y;
+  return a.z < b.z;
+}
+
+// intersections of edges with the plane
+// the edge is always intersected in canonical vertex order, so both facets sharing the edge
+// get bitwise identical point, and it is computed only once
+// entries are dropped once the second facet asked, so only the edges crossing the plane
+// whose other facet hasn't been seen yet are kept
+struct stl_intersection_cache {
+  std::vector<stl_vertex_pair> edges;
+  std::vector<stl_vertex> points; // intersection of every edge
+  stl_id_table table;
+  
+  // hash of the edge of an entry
+  struct entry_hash {
+    const std::vector<stl_vertex_pair> &edges;
+    entry_hash(const std::vector<stl_vertex_pair> &edges) : edges(edges) {}
+    size_t operator()(int id) const {
+      return stl_vertex_pair_hash()(edges[id]);
+    }
+  };
+  
+  void clear() {
+    edges.clear();
+    points.clear();
+    table.clear(0);
+  }
+  
+  // slot of the edge, or the empty slot it would take
+  size_t find(const stl_vertex_pair &edge) const {
+    size_t slot = table.first(stl_vertex_pair_hash()(edge));
+    while (table.slots[slot] >= 0 && !(edges[table.slots[slot]] == edge))
+      slot = table.next(slot);
+    return slot;
+  }
+  
+  stl_vertex intersection(stl_plane &plane, stl_vertex a, stl_vertex b) {
+    if (vertex_less(b, a)) std::swap(a, b);
+    stl_vertex_pair edge(a, b);
+    size_t slot = find(edge);
+    int id = table.slots[slot];
+    if (id >= 0) {
+      stl_vertex result = points[id];
+      // the last entry takes the place of the dropped one
+      table.erase(slot, entry_hash(edges));
+      int last = edges.size() - 1;
+      if (id != last) {
+        table.slots[find(edges[last])] = id;
+        edges[id] = edges[last];
+        points[id] = points[last];
+      }
+      edges.pop_back();
+      points.pop_back();
+      return result;
+    }
+    stl_vertex result = plane.intersection(a, b);
+    if (table.full(edges.size())) {
+      table.clear(2 * (edges.size() + 1));
+      for (size_t i = 0; i < edges.size(); i++)
+        table.slots[find(edges[i])] = i;
+      slot = find(edge);
+    }
+    table.slots[slot] = edges.size();
+    edges.push_back(edge);
+    points.push_back(result);
+    return result;
+  }
+};
+
+// cases of separate(), counted for the statistics
+enum stl_case { case_above, case_below, case_coplanar, case_edge_on, case_vertex_on,
+                case_simple_cut, case_complex_cut, CASES };
+static const char* case_names[CASES] = { "above", "below", "coplanar", "edge_on", "vertex_on",
+                                         "simple_cut", "complex_cut" };
+
+struct stl_case_counts {
+  long count[CASES];
+  
+  stl_case_counts() {
+    memset(count, 0, sizeof(count));
+  }
+  
+  long& operator[](int i) {
+    return count[i];
+  }
+  
+  void add(const stl_case_counts &other) {
+    for (size_t i = 0; i < CASES; i++) count[i] += other.count[i];
+  }
+};
+
+// wall time, CPU time and peak memory of the cut phases and counters, printed by --stats
+// phases of the same name (chunks, slabs) are summed up
+struct stl_report {
+  struct phase {
+    const char* name;
+    double wall;
+    double cpu;
+    long peak_rss;
+  };
+  std::vector<phase> phases;
+  double wall_start;
+  double cpu_start;
+  
+  stl_case_counts cases;
+  long input_facets;
+  long output_facets;
+  long border_edges;
+  long loops;
+  long cap_facets;
+  long cap_allocations; // served by the arenas
+  long cap_mallocs;     // arena chunks allocated
+  
+  stl_report() {
+    clear();
+  }
+  
+  // resets the report, keeping the memory
+  void clear() {
+    phases.clear();
+    cases = stl_case_counts();
+    wall_start = cpu_start = 0;
+    input_facets = output_facets = border_edges = loops = cap_facets = 0;
+    cap_allocations = cap_mallocs = 0;
+  }
+  
+  static double now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+  }
+  
+  // starts timing of a phase
+  void start() {
+    wall_start = now(CLOCK_MONOTONIC);
+    cpu_start = now(CLOCK_PROCESS_CPUTIME_ID);
+  }
+  
+  // ends timing of the phase started last
+  void stop(const char* name) {
+    double wall = now(CLOCK_MONOTONIC) - wall_start;
+    double cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    for (std::vector<phase>::iterator i = phases.begin(); i != phases.end(); i++) {
+      if (!strcmp(i->name, name)) {
+        i->wall += wall;
+        i->cpu += cpu;
+        i->peak_rss = usage.ru_maxrss;
+        return;
+      }
+    }
+    phase p = { name, wall, cpu, usage.ru_maxrss };
+    phases.push_back(p);
+  }
+  
+  // adds the phases and the output of another report,
+  // overlapping phases (timed at the same time) take the longer wall time
+  void add(const stl_report &other, bool overlapping) {
+    for (std::vector<phase>::const_iterator o = other.phases.begin(); o != other.phases.end(); o++) {
+      std::vector<phase>::iterator i = phases.begin();
+      while (i != phases.end() && strcmp(i->name, o->name)) i++;
+      if (i == phases.end()) {
+        phases.push_back(*o);
+        continue;
+      }
+      i->wall = overlapping ? STL_MAX(i->wall, o->wall) : i->wall + o->wall;
+      i->cpu += o->cpu;
+      i->peak_rss = STL_MAX(i->peak_rss, o->peak_rss);
+    }
+    output_facets += other.output_facets;
+  }
+  
+  // prints the report as JSON
+  void print(FILE* fp) {
+    fprintf(fp, "{\n  \"phases\": [\n");
+    for (std::vector<phase>::iterator i = phases.begin(); i != phases.end(); i++) {
+      fprintf(fp, "    {\"name\": \"%s\", \"wall_s\": %.6f, \"cpu_s\": %.6f, \"peak_rss_kb\": %ld}%s\n",
+              i->name, i->wall, i->cpu, i->peak_rss, i+1 == phases.end() ? "" : ",");
+    }
+    fprintf(fp, "  ],\n  \"cases\": {");
+    for (size_t i = 0; i < CASES; i++)
+      fprintf(fp, "%s\"%s\": %ld", i ? ", " : "", case_names[i], cases.count[i]);
+    fprintf(fp, "},\n");
+    fprintf(fp, "  \"input_facets\": %ld,\n  \"output_facets\": %ld,\n", input_facets, output_facets);
+    fprintf(fp, "  \"border_edges\": %ld,\n  \"loops\": %ld,\n  \"cap_facets\": %ld,\n",
+            border_edges, loops, cap_facets);
+    fprintf(fp, "  \"cap_allocations\": %ld,\n  \"cap_mallocs\": %ld\n}\n", cap_allocations, cap_mallocs);
   }
 };
 
@@ -168,39 +453,39 @@ stl_facet semifacet(stl_facet original, stl_vertex a, stl_vertex b, stl_vertex c
 
 // one of the vertices is on the plane and we cut the facet to two
 void simple_cut(stl_vertex zero, stl_vertex one, stl_vertex two, stl_facet facet, stl_plane plane,
-              std::deque<stl_facet> &first, std::deque<stl_facet> &second,
-              std::set<stl_vertex_pair> &border) {
-  stl_vertex middle = plane.intersection(one, two);
+              std::vector<stl_facet> &first, std::vector<stl_facet> &second,
+              std::vector<stl_vertex_pair> &border, stl_intersection_cache &cache) {
+  stl_vertex middle = cache.intersection(plane, one, two);
   first.push_back(semifacet(facet, middle, zero, one));
   second.push_back(semifacet(facet, middle, two, zero));
-  border.insert(stl_vertex_pair(one,middle));
+  border.push_back(stl_vertex_pair(zero,middle));
 }
 
 // no vertex is on the plane and we cut the facet to three
 void complex_cut(stl_vertex zero, stl_vertex one, stl_vertex two, stl_facet facet, stl_plane plane,
-              std::deque<stl_facet> &first, std::deque<stl_facet> &second,
-              std::set<stl_vertex_pair> &border) {
-  stl_vertex one_middle = plane.intersection(zero, one);
-  stl_vertex two_middle = plane.intersection(zero, two);
+              std::vector<stl_facet> &first, std::vector<stl_facet> &second,
+              std::vector<stl_vertex_pair> &border, stl_intersection_cache &cache) {
+  stl_vertex one_middle = cache.intersection(plane, zero, one);
+  stl_vertex two_middle = cache.intersection(plane, zero, two);
   first.push_back(semifacet(facet, zero, one_middle, two_middle));
   second.push_back(semifacet(facet, one_middle, one, two));
   second.push_back(semifacet(facet, one_middle, two, two_middle));
-  border.insert(stl_vertex_pair(one_middle,two_middle));
+  border.push_back(stl_vertex_pair(one_middle,two_middle));
 }
 
-// given facet is classified and distributed to upper or lower deque
+// given facet is classified and distributed to upper or lower part
 // is cut to smaller ones when necessary
-// border edges ends in border set for further triangulation
-void separate(stl_facet facet, stl_plane plane,
-              std::deque<stl_facet> &upper, std::deque<stl_facet> &lower,
-              std::set<stl_vertex_pair> &border) {
-  stl_position pos[3];
+// border edges end in border vector for further triangulation
+// the vertex positions are already known
+void separate(stl_facet facet, stl_plane plane, const stl_position pos[3],
+              std::vector<stl_facet> &upper, std::vector<stl_facet> &lower,
+              std::vector<stl_vertex_pair> &border, stl_intersection_cache &cache,
+              stl_case_counts &counts) {
   size_t aboves = 0;
   size_t belows = 0;
   size_t ons = 0;
   
   for (size_t i = 0; i < 3; i++) {
-    pos[i] = plane.position(facet.vertex[i]);
     if (pos[i]==above) aboves++;
     else if (pos[i]==below) belows++;
     else ons++;
@@ -208,28 +493,34 @@ void separate(stl_facet facet, stl_plane plane,
     
   // All vertexes are above the plane
   if (aboves == 3) {
+    counts[case_above]++;
     upper.push_back(facet);
     return;
   }
   
   // All vertexes are below the plane
   if (belows == 3) {
+    counts[case_below]++;
     lower.push_back(facet);
     return;
   }
   
   // All vertexes are on the plane
-  if (ons == 3) return;
+  if (ons == 3) {
+    counts[case_coplanar]++;
+    return;
+  }
   
   // 2 vertexes are on the plane
   if (ons == 2) {
+    counts[case_edge_on]++;
     for (size_t i = 0; i < 3; i++) {
       if (pos[i] == above) {
         upper.push_back(facet);
-        border.insert(stl_vertex_pair(facet.vertex[(i+1)%3],facet.vertex[(i+2)%3]));
+        border.push_back(stl_vertex_pair(facet.vertex[(i+1)%3],facet.vertex[(i+2)%3]));
       } else if (pos[i] == below) {
         lower.push_back(facet);
-        border.insert(stl_vertex_pair(facet.vertex[(i+2)%3],facet.vertex[(i+1)%3]));
+        border.push_back(stl_vertex_pair(facet.vertex[(i+2)%3],facet.vertex[(i+1)%3]));
       }
     }
     return;
@@ -249,25 +540,29 @@ void separate(stl_facet facet, stl_plane plane,
       }
     }
     if (aboves == 2) {
+      counts[case_vertex_on]++;
       upper.push_back(facet);
       return;
     }
     if (belows == 2) {
+      counts[case_vertex_on]++;
       lower.push_back(facet);
       return;
     }
+    counts[case_simple_cut]++;
     if (onepos == above)
-      simple_cut(zero, one, two, facet, plane, upper, lower, border);
+      simple_cut(zero, one, two, facet, plane, upper, lower, border, cache);
     else
-      simple_cut(zero, one, two, facet, plane, lower, upper, border);
+      simple_cut(zero, one, two, facet, plane, lower, upper, border, cache);
     return;
   }
   
   // no vertexes on the plane
+  counts[case_complex_cut]++;
   if  (aboves == 1) { // belows == 2
     for (size_t i = 0; i < 3; i++) {
       if (pos[i] == above) {
-        complex_cut(facet.vertex[i], facet.vertex[(i+1)%3], facet.vertex[(i+2)%3], facet, plane, upper, lower, border);
+        complex_cut(facet.vertex[i], facet.vertex[(i+1)%3], facet.vertex[(i+2)%3], facet, plane, upper, lower, border, cache);
         return;
       }
     }
@@ -275,168 +570,3274 @@ void separate(stl_facet facet, stl_plane plane,
   // belows == 1, aboves == 2
   for (size_t i = 0; i < 3; i++) {
     if (pos[i] == below) {
-      complex_cut(facet.vertex[i], facet.vertex[(i+1)%3], facet.vertex[(i+2)%3], facet, plane, lower, upper, border);
+      complex_cut(facet.vertex[i], facet.vertex[(i+1)%3], facet.vertex[(i+2)%3], facet, plane, lower, upper, border, cache);
       return;
     }
   }
 }
 
-// exports stl file form given deque
-void export_stl(std::deque<stl_facet> facets, const char* name) {
-  stl_file stl_out;
-  stl_out.stats.type = inmemory;
-  stl_out.stats.number_of_facets = facets.size();
-  stl_out.stats.original_num_facets = stl_out.stats.number_of_facets;
-  stl_out.v_indices = NULL;
-  stl_out.v_shared = NULL;
-  stl_out.neighbors_start = NULL;
-  stl_clear_error(&stl_out);
-  stl_allocate(&stl_out);
+void separate(stl_facet facet, stl_plane plane,
+              std::vector<stl_facet> &upper, std::vector<stl_facet> &lower,
+              std::vector<stl_vertex_pair> &border, stl_intersection_cache &cache,
+              stl_case_counts &counts) {
+  stl_position pos[3];
+  for (size_t i = 0; i < 3; i++)
+    pos[i] = plane.position(facet.vertex[i]);
+  separate(facet, plane, pos, upper, lower, border, cache, counts);
+}
+
+// returns the number of facets if the opened file is a binary STL, -1 otherwise
+// the header facet count has to match the file size exactly,
+// ASCII files (and binary files starting with "solid") are told apart this way
+long binary_facets(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_SIZE) return -1;
+  unsigned char count[NUM_FACET_SIZE];
+  if (pread(fd, count, NUM_FACET_SIZE, LABEL_SIZE) != NUM_FACET_SIZE) return -1;
+  size_t facets = count[0] | count[1] << 8 | count[2] << 16 | (size_t)count[3] << 24;
+  if ((size_t)st.st_size != HEADER_SIZE + facets*SIZEOF_STL_FACET || facets > 0x7fffffff) return -1;
+  return facets;
+}
+
+// whitespace as fscanf sees it
+inline bool ascii_space(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+}
+
+// exact powers of ten in double
+static const double decimal_powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// the float nearest to mantissa * 10^exponent, when one double operation gives it for sure:
+// the operation is exact and rounded once, the rounding to float is fine unless it is a tie
+// returns false otherwise
+bool decimal_float(unsigned long long mantissa, int exponent, float &value) {
+  if (mantissa > (1ULL << 53) || exponent < -22 || exponent > 22) return false;
+  double result = exponent < 0 ? mantissa / decimal_powers[-exponent] : mantissa * decimal_powers[exponent];
+  unsigned long long bits;
+  memcpy(&bits, &result, sizeof(bits));
+  if (result != 0 && (result < FLT_MIN || result > FLT_MAX || (bits & 0x1fffffff) == 0x10000000)) return false;
+  value = (float)result;
+  return true;
+}
+
+// returns the start of the first "facet normal" in the text, or end
+const char* find_facet(const char* begin, const char* end) {
+  const char* p = begin;
+  while ((p = (const char*)memmem(p, end - p, "normal", 6))) {
+    const char* q = p;
+    while (q > begin && ascii_space(q[-1])) q--;
+    if (q < p && q - begin >= 5 && !memcmp(q - 5, "facet", 5) && (q - 5 == begin || ascii_space(q[-6])))
+      return q - 5;
+    p += 6;
+  }
+  return end;
+}
+
+// reads facets from a part of ASCII STL text
+// numbers come out the same as from strtof, plain decimal ones without calling it
+struct stl_ascii_parser {
+  const char* p;
+  const char* end;
   
-  int first = 1;
-  for (std::deque<stl_facet>::const_iterator facet = facets.begin(); facet != facets.end(); facet++) {
-    stl_out.facet_start[facet - facets.begin()] = *facet;
-    stl_facet_stats(&stl_out, *facet, first);
-    first = 0;
+  stl_ascii_parser(const char* begin, const char* end) {
+    this->p = begin;
+    this->end = end;
   }
   
-  // check nearby in 2 iterations
-  // remove unconnected facets
-  // fill holes
-  stl_repair(&stl_out, 0, 0, 0, 0, 0, 0, 1, 2, 1, 1, 0, 0, 0, 0);
-  stl_write_ascii(&stl_out, name, "stlcut");
-  stl_clear_error(&stl_out);
-  stl_close(&stl_out);
+  void skip() {
+    while (p < end && ascii_space(*p)) p++;
+  }
+  
+  // the word has to be followed by whitespace or the end
+  bool keyword(const char* word) {
+    skip();
+    size_t n = strlen(word);
+    if ((size_t)(end - p) < n || memcmp(p, word, n) || (p + n < end && !ascii_space(p[n]))) return false;
+    p += n;
+    return true;
+  }
+  
+  bool number(float &value) {
+    skip();
+    const char* q = p;
+    bool negative = q < end && *q == '-';
+    if (q < end && (*q == '-' || *q == '+')) q++;
+    unsigned long long mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool exact = true, any = false;
+    for (bool fraction = false; q < end; q++) {
+      if (*q == '.' && !fraction) {
+        fraction = true;
+        continue;
+      }
+      if (*q < '0' || *q > '9') break;
+      any = true;
+      if (digits == 19) {
+        exact = false;
+        continue;
+      }
+      mantissa = mantissa * 10 + (*q - '0');
+      if (mantissa) digits++;
+      if (fraction) exponent--;
+    }
+    if (any && q < end && (*q == 'e' || *q == 'E')) {
+      q++;
+      bool minus = q < end && *q == '-';
+      if (q < end && (*q == '-' || *q == '+')) q++;
+      int e = 0;
+      if (q == end || *q < '0' || *q > '9') exact = false;
+      for (; q < end && *q >= '0' && *q <= '9'; q++)
+        if (e < 10000) e = e * 10 + (*q - '0');
+      exponent += minus ? -e : e;
+    }
+    
+    if (any && exact && (q == end || ascii_space(*q)) && decimal_float(mantissa, exponent, value)) {
+      if (negative) value = -value;
+      p = q;
+      return true;
+    }
+    
+    // anything else (long mantissas, ties, subnormals, inf, nan)
+    q = p;
+    while (q < end && !ascii_space(*q)) q++;
+    char token[64];
+    if (q == p || q - p >= (long)sizeof(token)) return false;
+    memcpy(token, p, q - p);
+    token[q - p] = 0;
+    char* rest;
+    value = strtof(token, &rest);
+    if (rest != token + (q - p)) return false;
+    p = q;
+    return true;
+  }
+  
+  bool facet(stl_facet &f) {
+    if (!keyword("facet") || !keyword("normal")) return false;
+    if (!number(f.normal.x) || !number(f.normal.y) || !number(f.normal.z)) return false;
+    if (!keyword("outer") || !keyword("loop")) return false;
+    for (size_t i = 0; i < 3; i++) {
+      if (!keyword("vertex")) return false;
+      if (!number(f.vertex[i].x) || !number(f.vertex[i].y) || !number(f.vertex[i].z)) return false;
+    }
+    if (!keyword("endloop") || !keyword("endfacet")) return false;
+    f.extra[0] = f.extra[1] = 0;
+    return true;
+  }
+};
+
+// one part of ASCII STL text, from a facet start to the start of the next part
+struct stl_ascii_part {
+  const char* begin;
+  const char* end;
+  size_t first; // index of the first facet of the part
+  size_t count;
+  bool ok;
+};
+
+void count_ascii_facets(stl_ascii_part* part) {
+  part->count = 0;
+  for (const char* p = find_facet(part->begin, part->end); p < part->end; p = find_facet(p + 5, part->end))
+    part->count++;
 }
 
-// vertex comparison with tolerance
-bool is_same(stl_vertex a, stl_vertex b, float tolerance) {
-  return (ABS(a.x-b.x)<tolerance && ABS(a.y-b.y)<tolerance);
+// every facet of the part has to parse, the last part may only close the solid after them
+void parse_ascii_facets(stl_ascii_part* part, bool last, stl_facet* facets) {
+  stl_ascii_parser parser(part->begin, part->end);
+  part->ok = false;
+  for (size_t i = 0; i < part->count; i++)
+    if (!parser.facet(facets[part->first + i])) return;
+  if (last && parser.keyword("endsolid")) {
+    // the name, then nothing else
+    const char* name_end = (const char*)memchr(parser.p, '\n', parser.end - parser.p);
+    if (name_end) parser.p = name_end;
+    else parser.p = parser.end;
+  }
+  parser.skip();
+  part->ok = parser.p == part->end;
 }
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    std::cerr << "Usage: " << argv[0] << " file.stl" << std::endl;
-    return 1;
+// parses the whole mapped ASCII STL file to facets, in the order of the file
+// returns false if the text isn't plain ASCII STL, admesh gets the file then
+bool parse_ascii(const char* text, size_t size, int threads, std::vector<stl_facet> &facets) {
+  const char* end = text + size;
+  stl_ascii_parser header(text, end);
+  if (!header.keyword("solid")) return false;
+  const char* begin = (const char*)memchr(header.p, '\n', end - header.p);
+  if (!begin) return false;
+  
+  // split at facet starts near even offsets
+  threads = STL_MAX(1, STL_MIN(threads, (int)(size / ASCII_THREAD_MIN_SIZE)));
+  std::vector<stl_ascii_part> parts(threads);
+  for (int t = 0; t < threads; t++) {
+    parts[t].begin = t ? find_facet(STL_MAX(begin, text + size*t/threads), end) : begin;
+    if (t) parts[t].begin = STL_MAX(parts[t].begin, parts[t-1].begin);
+    if (t) parts[t-1].end = parts[t].begin;
   }
+  parts[threads-1].end = end;
   
-  // TODO remove the algorithm from main() and provide interface using 3 stl structs (in, out, out)
+  std::vector<std::thread> workers;
+  for (int t = 1; t < threads; t++)
+    workers.push_back(std::thread(count_ascii_facets, &parts[t]));
+  count_ascii_facets(&parts[0]);
+  for (int t = 1; t < threads; t++)
+    workers[t-1].join();
   
-  stl_file stl_in;
-  stl_open(&stl_in, argv[1]);
-  stl_exit_on_error(&stl_in);
-  stl_plane plane = stl_plane(0,0,1,0);
+  size_t count = 0;
+  for (int t = 0; t < threads; t++) {
+    parts[t].first = count;
+    count += parts[t].count;
+  }
+  if (count > 0x7fffffff) return false;
+  facets.resize(count);
+  stl_facet* memory = count ? &facets[0] : NULL;
   
-  std::set<stl_vertex_pair> border;
-  std::deque<stl_facet> upper, lower;
+  workers.clear();
+  for (int t = 1; t < threads; t++)
+    workers.push_back(std::thread(parse_ascii_facets, &parts[t], t == threads - 1, memory));
+  parse_ascii_facets(&parts[0], threads == 1, memory);
+  bool ok = parts[0].ok;
+  for (int t = 1; t < threads; t++) {
+    workers[t-1].join();
+    ok = ok && parts[t].ok;
+  }
+  return ok;
+}
+
+// input mesh
+// binary STL files are memory mapped and facets are read right from the 50 byte records,
+// ASCII files are mapped and parsed on several threads,
+// anything else is loaded by admesh
+struct stl_input {
+  stl_file stl;
+  bool loaded;
+  void* map;
+  size_t map_size;
+  const char* records;
+  std::vector<stl_facet> parsed; // facets of an ASCII file
+  int number_of_facets;
   
-  // separate all facets
-  for (int i = 0; i < stl_in.stats.number_of_facets; i++)
-    separate(stl_in.facet_start[i], plane, upper, lower, border);
+  stl_input() {
+    loaded = false;
+    map = NULL;
+    map_size = 0;
+    records = NULL;
+    number_of_facets = 0;
+  }
   
-  stl_close(&stl_in);
+  // try to map the file as binary STL, returns false if it isn't one
+  bool map_binary(const char* name) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    // records are little endian, let admesh swap the bytes
+    return false;
+#endif
+    int fd = ::open(name, O_RDONLY);
+    if (fd < 0) return false;
+    long facets = binary_facets(fd);
+    if (facets < 0) {
+      ::close(fd);
+      return false;
+    }
+    
+    size_t size = HEADER_SIZE + (size_t)facets*SIZEOF_STL_FACET;
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) return false;
+    madvise(data, size, MADV_SEQUENTIAL);
+    
+    map = data;
+    map_size = size;
+    records = (const char*)data + HEADER_SIZE;
+    number_of_facets = facets;
+    return true;
+  }
   
-  std::deque<stl_vertex_pair> border2d;
+  // try to parse the file as ASCII STL, returns false if it isn't plain ASCII STL
+  bool map_ascii(const char* name, int threads) {
+    int fd = ::open(name, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      return false;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) return false;
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    bool ok = parse_ascii((const char*)data, st.st_size, threads, parsed);
+    munmap(data, st.st_size);
+    if (!ok) {
+      std::vector<stl_facet>().swap(parsed);
+      return false;
+    }
+    number_of_facets = parsed.size();
+    return true;
+  }
   
-  // transform the border points coordinates to 2D
-  // get a tolerance for further comparison
-  stl_vertex origin = (*border.begin()).x;
-  float tolerance;
-  for (std::set<stl_vertex_pair>::iterator i = border.begin(); i != border.end(); i++) {
-    stl_vertex x = plane.to_2D((*i).x, origin);
-    stl_vertex y = plane.to_2D((*i).y, origin);
-    border2d.push_back(stl_vertex_pair(x,y));
-    if (i == border.begin()) {
-      tolerance = ABS(x.x-y.x)+ABS(x.y-y.y);
-    } else {
-      tolerance = STL_MIN(tolerance,ABS(x.x-y.x)+ABS(x.y-y.y));
-    }
-  }
-  tolerance /= 4; // TODO this needs some clarification or even replacing
-  
-  // sort the edges to make a polygon
-  std::deque<stl_vertex> polyline;
-  stl_vertex_pair pair = border2d.front();
-  border2d.pop_front();
-  polyline.push_back(pair.x);
-  polyline.push_back(pair.y);
-  bool found = true;
-    
-  while (found) {
-    found = false;
-    for (std::deque<stl_vertex_pair>::iterator i = border2d.begin(); i != border2d.end(); i++) {
-      if (is_same(polyline.back(), (*i).x, tolerance)) {
-        polyline.push_back((*i).y);
-        border2d.erase(i);
-        found = true;
-        break;
+  // open the file, returns false on error
+  bool open(const char* name, int threads) {
+    if (map_binary(name)) return true;
+    if (map_ascii(name, threads)) return true;
+    
+    stl_open(&stl, name);
+    if (stl_get_error(&stl)) {
+      stl_close(&stl);
+      return false;
+    }
+    loaded = true;
+    number_of_facets = stl.stats.number_of_facets;
+    return true;
+  }
+  
+  void close() {
+    if (map) munmap(map, map_size);
+    if (loaded) stl_close(&stl);
+    map = NULL;
+    records = NULL;
+    loaded = false;
+    std::vector<stl_facet>().swap(parsed);
+    number_of_facets = 0;
+  }
+  
+  // returns i-th facet of the mesh
+  stl_facet facet(int i) const {
+    if (!loaded && !records) return parsed[i];
+    if (!records) return stl.facet_start[i];
+    stl_facet f;
+    memcpy(&f, records + (size_t)i*SIZEOF_STL_FACET, SIZEOF_STL_FACET);
+    return f;
+  }
+};
+
+// reads facets of a binary or ASCII STL file in chunks, never holding the whole mesh
+struct stl_reader {
+  FILE* fp;
+  bool ascii;
+  long remaining;
+  long position; // facets read so far
+  bool ended; // the ASCII facets ended
+  bool error; // and not at endsolid or the end of the file
+  std::vector<char> records; // binary records of the last read
+  
+  stl_reader() {
+    fp = NULL;
+    ascii = false;
+    remaining = 0;
+    position = 0;
+    ended = error = false;
+  }
+  
+  // open the file, returns false on error
+  bool open(const char* name) {
+    fp = fopen(name, "rb");
+    if (!fp) return false;
+    position = 0;
+    ended = error = false;
+    remaining = binary_facets(fileno(fp));
+    ascii = remaining < 0;
+    if (ascii) {
+      // skip the solid line
+      if (fscanf(fp, "%*[^\n]") == EOF) {
+        close();
+        return false;
       }
-      if (is_same(polyline.back(), (*i).y, tolerance)) {
-        polyline.push_back((*i).x);
-        border2d.erase(i);
-        found = true;
-        break;
+    } else {
+      fseek(fp, HEADER_SIZE, SEEK_SET);
+    }
+    return true;
+  }
+  
+  void close() {
+    if (fp) fclose(fp);
+    fp = NULL;
+  }
+  
+  // reads up to count facets to the buffer, returns the number of facets read, 0 at the end
+  // ASCII text other than facets before endsolid stops the reading with error set
+  int read(stl_facet* facets, int count) {
+    if (ascii) {
+      int n = 0;
+      for (; n < count && !ended; n++) {
+        stl_facet &f = facets[n];
+        long start = ftell(fp);
+        if (fscanf(fp, " facet normal %f %f %f outer loop"
+                   " vertex %f %f %f vertex %f %f %f vertex %f %f %f endloop endfacet",
+                   &f.normal.x, &f.normal.y, &f.normal.z,
+                   &f.vertex[0].x, &f.vertex[0].y, &f.vertex[0].z,
+                   &f.vertex[1].x, &f.vertex[1].y, &f.vertex[1].z,
+                   &f.vertex[2].x, &f.vertex[2].y, &f.vertex[2].z) != 12) {
+          // a facet read only in part is an error too, the word it starts with is looked at
+          char word[9];
+          fseek(fp, start, SEEK_SET);
+          error = fscanf(fp, " %8s", word) == 1 && strcmp(word, "endsolid");
+          ended = true;
+          break;
+        }
+        f.extra[0] = f.extra[1] = 0;
       }
+      position += n;
+      return n;
     }
-    if (!found) {
-      break;
-      // TODO there might still be some edges left, create multiple polygons
-      // TODO (hard) also recognize holes
+    
+    if (remaining < count) count = remaining;
+    records.resize((size_t)count*SIZEOF_STL_FACET);
+    int n = fread(&records[0], SIZEOF_STL_FACET, count, fp);
+    for (int i = 0; i < n; i++)
+      memcpy(facets + i, &records[(size_t)i*SIZEOF_STL_FACET], SIZEOF_STL_FACET);
+    remaining -= n;
+    position += n;
+    return n;
+  }
+};
+
+// shortest %g reading back as the same float, for the numbers format_float() leaves out
+char* format_float_slowly(float value, char* out) {
+  int n = 0;
+  for (int p = 1; p <= 9; p++) {
+    n = sprintf(out, "%.*g", p, value);
+    if (strtof(out, NULL) == value) break;
+  }
+  return out + n;
+}
+
+// writes the shortest decimal reading back as the same float, returns the end of the text
+// the digits are found in doubles and every candidate is checked with decimal_float(),
+// very small and very big numbers go to format_float_slowly()
+char* format_float(float value, char* out) {
+  if (value != value || value - value != 0) return out + sprintf(out, "%g", value);
+  if (value < 0 || (value == 0 && 1 / value < 0)) *out++ = '-';
+  double v = fabs(value);
+  if (v == 0) {
+    *out++ = '0';
+    return out;
+  }
+  
+  // v is in [10^k, 10^(k+1))
+  int binary;
+  frexp(v, &binary);
+  int k = (int)floor((binary - 1) * 0.30102999566398120);
+  if (k < -14 || k > 14) return format_float_slowly(v, out);
+  if (k + 1 >= 0 ? v >= decimal_powers[k+1] : v * decimal_powers[-k-1] >= 1) k++;
+  
+  // p significant digits, nearest to v
+  // a shorter number reading back means a longer one does too, so the length is bisected
+  unsigned long long digits = 0, candidate;
+  int length = 0;
+  for (int low = 1, high = 9; low <= high;) {
+    int p = (low + high) / 2;
+    int scale = p - 1 - k;
+    candidate = (unsigned long long)llround(scale < 0 ? v / decimal_powers[-scale] : v * decimal_powers[scale]);
+    float back;
+    if (decimal_float(candidate, -scale, back) && back == (float)v) {
+      digits = candidate;
+      length = p;
+      high = p - 1;
+    } else {
+      low = p + 1;
+    }
+  }
+  if (!length) return format_float_slowly(v, out);
+  // rounded up to the next power of ten
+  if (digits == (unsigned long long)decimal_powers[length]) {
+    digits /= 10;
+    k++;
+  }
+  while (length > 1 && digits % 10 == 0) {
+    digits /= 10;
+    length--;
+  }
+  
+  char text[16];
+  for (int i = length - 1; i >= 0; i--, digits /= 10)
+    text[i] = '0' + digits % 10;
+  
+  if (k < -5 || k > 8) {
+    // scientific, like %g
+    *out++ = text[0];
+    if (length > 1) {
+      *out++ = '.';
+      memcpy(out, text + 1, length - 1);
+      out += length - 1;
+    }
+    return out + sprintf(out, "e%c%02d", k < 0 ? '-' : '+', k < 0 ? -k : k);
+  }
+  if (k < 0) {
+    *out++ = '0';
+    *out++ = '.';
+    for (int i = -1; i > k; i--) *out++ = '0';
+    memcpy(out, text, length);
+    return out + length;
+  }
+  for (int i = 0; i <= k; i++) *out++ = i < length ? text[i] : '0';
+  if (length > k + 1) {
+    *out++ = '.';
+    memcpy(out, text + k + 1, length - k - 1);
+    out += length - k - 1;
+  }
+  return out;
+}
+
+// ASCII text of a facet in the layout of stl_write_ascii, returns the end of the text
+// STL_ASCII_FACET_SIZE bounds its size
+#define STL_ASCII_FACET_SIZE 512
+char* format_facet(const stl_facet &facet, char* out) {
+  static const char normal[] = "  facet normal ";
+  static const char loop[] = "\n    outer loop\n";
+  static const char vertex[] = "      vertex ";
+  static const char end[] = "    endloop\n  endfacet\n";
+  memcpy(out, normal, sizeof(normal) - 1);
+  out += sizeof(normal) - 1;
+  const float* values = &facet.normal.x;
+  for (size_t i = 0; i < 3; i++) {
+    if (i) *out++ = ' ';
+    out = format_float(values[i], out);
+  }
+  memcpy(out, loop, sizeof(loop) - 1);
+  out += sizeof(loop) - 1;
+  for (size_t j = 0; j < 3; j++) {
+    memcpy(out, vertex, sizeof(vertex) - 1);
+    out += sizeof(vertex) - 1;
+    values = &facet.vertex[j].x;
+    for (size_t i = 0; i < 3; i++) {
+      if (i) *out++ = ' ';
+      out = format_float(values[i], out);
     }
+    *out++ = '\n';
   }
+  memcpy(out, end, sizeof(end) - 1);
+  return out + sizeof(end) - 1;
+}
+
+// formats facets [begin, end) to the text buffer
+void format_facets(const stl_facet* facets, int begin, int end, std::vector<char>* text) {
+  text->resize((size_t)(end - begin) * STL_ASCII_FACET_SIZE);
+  char* out = &(*text)[0];
+  for (int i = begin; i < end; i++)
+    out = format_facet(facets[i], out);
+  text->resize(out - &(*text)[0]);
+}
+
+// writes facets to an STL file as they come
+// binary files get the facet count backpatched to the header when closed,
+// ASCII files have the layout of stl_write_ascii with the shortest numbers reading back the same,
+// bigger batches of ASCII facets are formatted on several threads
+struct stl_writer {
+  FILE* fp;
+  std::string name;
+  bool ascii;
+  int number_of_facets;
+  bool kernel_copy;
+  int threads;
+  std::vector<std::vector<char> > texts; // formatted ASCII facets, one per thread
   
-  // poly2tri doesn't like this
-  // the condition should always be true when the mesh is valid and no error happened
-  if (is_same(polyline.back(), polyline.front(), tolerance)) {
-    polyline.pop_back();
+  stl_writer() {
+    fp = NULL;
+    ascii = false;
+    number_of_facets = 0;
+    kernel_copy = true;
+    threads = 1;
   }
   
-  // TODO use p2t::Points right away from to_2D
-  std::vector<p2t::Point*> polygon;
-  for (std::deque<stl_vertex>::iterator i = polyline.begin(); i != polyline.end(); i++) {
-    polygon.push_back(new p2t::Point((*i).x,(*i).y));
+  // a file left open isn't finished, it's closed as it is
+  ~stl_writer() {
+    if (fp) fclose(fp);
+  }
+  
+  // open the file, returns false on error
+  bool open(const char* name, bool ascii) {
+    this->name = name;
+    this->ascii = ascii;
+    fp = fopen(name, ascii ? "w" : "wb");
+    if (!fp) return false;
+    setvbuf(fp, NULL, _IOFBF, WRITER_BUFFER_SIZE);
+    number_of_facets = 0;
+    if (ascii) {
+      fprintf(fp, "solid  %s\n", "stlcut");
+    } else {
+      // the count is just a placeholder for now
+      char header[HEADER_SIZE];
+      memset(header, 0, HEADER_SIZE);
+      strcpy(header, "stlcut");
+      fwrite(header, HEADER_SIZE, 1, fp);
+    }
+    return true;
+  }
+  
+  void write(stl_facet facet) {
+    number_of_facets++;
+    if (!ascii) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      float* values = &facet.normal.x;
+      for (size_t i = 0; i < 12; i++) values[i] = little_endian(values[i]);
+#endif
+      // the first 50 bytes of stl_facet are the binary record
+      fwrite(&facet, SIZEOF_STL_FACET, 1, fp);
+      return;
+    }
+    char text[STL_ASCII_FACET_SIZE];
+    fwrite(text, 1, format_facet(facet, text) - text, fp);
   }
   
-  // triangulate
-  p2t::CDT cdt = p2t::CDT(polygon);
-  cdt.Triangulate();
-  std::vector<p2t::Triangle*> triangles = cdt.GetTriangles();
+  void write(const std::vector<stl_facet> &facets) {
+    if (!facets.empty()) write(&facets[0], facets.size());
+  }
   
-  // for each triangle, create facet
-  for (std::vector<p2t::Triangle*>::iterator i = triangles.begin(); i != triangles.end(); i++) {
-    stl_vertex vertex;
-    stl_facet facet;
-    for (size_t j = 0; j < 3; j++) {
-      p2t::Point* p = (*i)->GetPoint(j);
-      vertex.x = p->x;
-      vertex.y = p->y;
-      vertex = plane.to_3D(vertex, origin);
-      facet.vertex[j].x = vertex.x;
-      facet.vertex[j].y = vertex.y;
-      facet.vertex[j].z = vertex.z;
-    }
-    // normal goes out of the object, for lower part, it is identical to plane normal
-    facet.normal.x = plane.x;
-    facet.normal.y = plane.y;
-    facet.normal.z = plane.z;
-    lower.push_back(facet);
+  void write(const stl_facet* facets, int count) {
+    if (!ascii) {
+      for (int i = 0; i < count; i++)
+        write(facets[i]);
+      return;
+    }
     
-    // for the upper part, we need to invert the normal...
-    facet.normal.x = -plane.x;
-    facet.normal.y = -plane.y;
-    facet.normal.z = -plane.z;
-    // ...and reverse the order of the vertices
-    // TODO check if the order of vertices from poly2tri in fact depends on orientation of the first used edge
-    // .. and the order might be reversed anyway
-    vertex = facet.vertex[1];
-    facet.vertex[1] = facet.vertex[2];
-    facet.vertex[2] = vertex;
-    upper.push_back(facet);
+    // batches of STREAM_CHUNK_FACETS per thread, the texts go out in order with big writes
+    int workers = STL_MAX(1, STL_MIN(threads, count / THREAD_MIN_FACETS));
+    if ((int)texts.size() < workers) texts.resize(workers);
+    for (int begin = 0; begin < count;) {
+      int end = STL_MIN(count, begin + workers * STREAM_CHUNK_FACETS);
+      std::vector<std::thread> formatters;
+      for (int t = 1; t < workers; t++)
+        formatters.push_back(std::thread(format_facets, facets, begin + (long)(end - begin)*t/workers,
+                                         begin + (long)(end - begin)*(t+1)/workers, &texts[t]));
+      format_facets(facets, begin, begin + (end - begin)/workers, &texts[0]);
+      for (int t = 0; t < workers; t++) {
+        if (t) formatters[t-1].join();
+        if (!texts[t].empty()) fwrite(&texts[t][0], 1, texts[t].size(), fp);
+      }
+      begin = end;
+    }
+    number_of_facets += count;
+  }
+  
+  // copies count binary records from the file fd at offset,
+  // raw holds the same records in case the kernel can't copy between the files
+  void copy(int fd, long offset, const char* raw, int count) {
+    number_of_facets += count;
+    size_t size = (size_t)count*SIZEOF_STL_FACET, done = 0;
+#ifdef __linux__
+    if (kernel_copy) {
+      fflush(fp);
+      loff_t from = offset;
+      while (done < size) {
+        ssize_t n = copy_file_range(fd, &from, fileno(fp), NULL, size - done, 0);
+        if (n <= 0) {
+          // not supported for these files, don't try again
+          if (n < 0) kernel_copy = false;
+          break;
+        }
+        done += n;
+      }
+    }
+#endif
+    fwrite(raw + done, 1, size - done, fp);
+  }
+  
+  // finish the file, returns false on error
+  bool close() {
+    if (ascii) {
+      fprintf(fp, "endsolid  %s\n", "stlcut");
+    } else {
+      unsigned char count[NUM_FACET_SIZE];
+      for (size_t i = 0; i < NUM_FACET_SIZE; i++)
+        count[i] = (unsigned)number_of_facets >> 8*i;
+      fseek(fp, LABEL_SIZE, SEEK_SET);
+      fwrite(count, NUM_FACET_SIZE, 1, fp);
+    }
+    bool ok = !ferror(fp);
+    if (fclose(fp) != 0) ok = false;
+    fp = NULL;
+    return ok;
   }
   
-  export_stl(upper, "upper.stl");
-  export_stl(lower, "lower.stl");
+  // closes an open file without finishing it and removes it
+  void discard() {
+    if (!fp) return;
+    fclose(fp);
+    fp = NULL;
+    remove(name.c_str());
+  }
   
-  return 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  static float little_endian(float value) {
+    char* bytes = (char*)&value;
+    std::swap(bytes[0], bytes[3]);
+    std::swap(bytes[1], bytes[2]);
+    return value;
+  }
+#endif
+};
+
+// fills the stl file with given facets
+// the facet memory of the file is reused when big enough
+void fill_stl(stl_file* stl, const std::vector<stl_facet> &facets) {
+  int count = facets.size();
+  // facets and neighbors are allocated together, like stl_allocate() does
+  if (!stl->facet_start || stl->stats.facets_malloced < count) {
+    int size = STL_MAX(count, 1);
+    stl_facet* memory = (stl_facet*)realloc(stl->facet_start, size * sizeof(stl_facet));
+    if (memory) stl->facet_start = memory;
+    stl_neighbors* neighbors = (stl_neighbors*)realloc(stl->neighbors_start, size * sizeof(stl_neighbors));
+    if (neighbors) stl->neighbors_start = neighbors;
+    if (!memory || !neighbors) {
+      stl->error = 1;
+      return;
+    }
+    stl->stats.facets_malloced = size;
+  }
+  
+  // shared vertices of the previous facets are invalid
+  free(stl->v_indices);
+  free(stl->v_shared);
+  stl->v_indices = NULL;
+  stl->v_shared = NULL;
+  
+  stl->stats.type = inmemory;
+  stl->stats.number_of_facets = count;
+  stl->stats.original_num_facets = count;
+  stl_clear_error(stl);
+  
+  int first = 1;
+  for (int i = 0; i < count; i++) {
+    stl->facet_start[i] = facets[i];
+    stl_facet_stats(stl, facets[i], first);
+    first = 0;
+  }
+}
+
+// exports stl file form given facets
+// the full repair is optional, the seam is welded by the cut already
+bool export_stl(const std::vector<stl_facet> &facets, const char* name, bool ascii, bool repair,
+                int threads, stl_report &report) {
+  stl_file stl_out;
+  memset(&stl_out, 0, sizeof(stl_out));
+  fill_stl(&stl_out, facets);
+  if (stl_get_error(&stl_out)) {
+    std::cerr << "Cannot allocate " << name << std::endl;
+    return false;
+  }
+  
+  // check nearby in 2 iterations
+  // remove unconnected facets
+  // fill holes
+  if (repair) {
+    report.start();
+    stl_repair(&stl_out, 0, 0, 0, 0, 0, 0, 1, 2, 1, 1, 0, 0, 0, 0);
+    report.stop("repair");
+  }
+  
+  report.start();
+  stl_writer writer;
+  writer.threads = threads;
+  bool ok = writer.open(name, ascii);
+  if (ok) {
+    writer.write(stl_out.facet_start, stl_out.stats.number_of_facets);
+    ok = writer.close();
+  }
+  report.output_facets += stl_out.stats.number_of_facets;
+  report.stop("write");
+  stl_clear_error(&stl_out);
+  stl_close(&stl_out);
+  if (!ok) std::cerr << "Cannot write " << name << std::endl;
+  return ok;
 }
 
+// closed polylines stored one after another in a flat array
+// loop i goes from points[starts[i]] to points[starts[i+1]-1]
+// seam holds the 3D border point of every 2D point
+struct stl_loops {
+  std::vector<stl_vertex> points;
+  std::vector<stl_vertex> seam;
+  std::vector<size_t> starts;
+  
+  size_t size() const {
+    return starts.empty() ? 0 : starts.size() - 1;
+  }
+  
+  size_t length(size_t i) const {
+    return starts[i+1] - starts[i];
+  }
+  
+  const stl_vertex* loop(size_t i) const {
+    return &points[starts[i]];
+  }
+  
+  const stl_vertex* loop_seam(size_t i) const {
+    return &seam[starts[i]];
+  }
+  
+  void clear() {
+    points.clear();
+    seam.clear();
+    starts.clear();
+  }
+};
+
+// edge of a loop for the nesting sweep, from left to right
+// top is true if the inside of the loop is below the edge
+struct stl_sweep_edge {
+  double x0, y0, x1, y1;
+  int loop;
+  bool top;
+};
+
+// sweep events at one x go as removals, insertions and queries of leftmost loop points
+enum stl_sweep_type { sweep_remove, sweep_insert, sweep_query };
+
+struct stl_sweep_event {
+  double x;
+  double y;
+  int type;
+  int id; // edge or loop
+  
+  bool operator<(const stl_sweep_event &other) const {
+    if (x != other.x) return x < other.x;
+    if (type != other.type) return type < other.type;
+    // a loop starting at the same x above a query has to be nested first
+    if (y != other.y) return type == sweep_query ? y > other.y : y < other.y;
+    return id < other.id;
+  }
+};
+
+// orders the edges crossing the sweep line from the bottom
+// edges from the same point are ordered by slope, the query point (id -1) goes above them
+struct stl_sweep_less {
+  const std::vector<stl_sweep_edge> &edges;
+  const double &x;
+  const double &query;
+  
+  stl_sweep_less(const std::vector<stl_sweep_edge> &edges, const double &x, const double &query)
+    : edges(edges), x(x), query(query) {}
+  
+  double y(int e) const {
+    if (e < 0) return query;
+    const stl_sweep_edge &edge = edges[e];
+    return edge.y0 + (edge.y1 - edge.y0) * (x - edge.x0) / (edge.x1 - edge.x0);
+  }
+  
+  double slope(int e) const {
+    if (e < 0) return HUGE_VAL;
+    const stl_sweep_edge &edge = edges[e];
+    return (edge.y1 - edge.y0) / (edge.x1 - edge.x0);
+  }
+  
+  bool operator()(int a, int b) const {
+    double ya = y(a), yb = y(b);
+    if (ya != yb) return ya < yb;
+    double sa = slope(a), sb = slope(b);
+    if (sa != sb) return sa < sb;
+    return a < b;
+  }
+};
+
+// memory handed out from big chunks and released all at once
+// the chunks are kept for the next use, so a warm arena doesn't call malloc at all
+struct stl_arena {
+  std::vector<char*> chunks;
+  std::vector<size_t> sizes;
+  size_t chunk; // the chunk allocated from
+  size_t used;  // bytes used of the chunk
+  long allocations;
+  long mallocs;
+  
+  stl_arena() {
+    chunk = used = 0;
+    allocations = mallocs = 0;
+  }
+  
+  ~stl_arena() {
+    for (size_t i = 0; i < chunks.size(); i++)
+      free(chunks[i]);
+  }
+  
+  // returns memory for size bytes, aligned like malloc()
+  void* allocate(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    allocations++;
+    while (chunk < chunks.size() && used + size > sizes[chunk]) {
+      chunk++;
+      used = 0;
+    }
+    if (chunk == chunks.size()) {
+      size_t bytes = STL_MAX(size, ARENA_CHUNK_SIZE);
+      char* memory = (char*)malloc(bytes);
+      if (!memory) throw std::bad_alloc();
+      chunks.push_back(memory);
+      sizes.push_back(bytes);
+      mallocs++;
+      used = 0;
+    }
+    void* result = chunks[chunk] + used;
+    used += size;
+    return result;
+  }
+  
+  template <class T>
+  T* allocate(size_t count) {
+    return (T*)allocate(count * sizeof(T));
+  }
+  
+  // frees everything allocated, keeping the chunks
+  void release() {
+    chunk = used = 0;
+  }
+};
+
+// allocator of the standard containers taking memory from an arena, freeing does nothing
+// the owner of the arena releases it once the container is gone
+template <class T>
+struct stl_arena_allocator {
+  typedef T value_type;
+  stl_arena* arena;
+  
+  stl_arena_allocator(stl_arena* arena) {
+    this->arena = arena;
+  }
+  
+  template <class U>
+  stl_arena_allocator(const stl_arena_allocator<U> &other) {
+    this->arena = other.arena;
+  }
+  
+  T* allocate(size_t count) {
+    return arena->allocate<T>(count);
+  }
+  
+  void deallocate(T*, size_t) {}
+  
+  template <class U>
+  bool operator==(const stl_arena_allocator<U> &other) const {
+    return arena == other.arena;
+  }
+  
+  template <class U>
+  bool operator!=(const stl_arena_allocator<U> &other) const {
+    return arena != other.arena;
+  }
+};
+
+// edges crossing the sweep line of nest_loops(), the nodes come from the sweep arena
+typedef std::set<int, stl_sweep_less, stl_arena_allocator<int> > stl_sweep_set;
+
+// scratch buffers of one cap triangulating thread
+// points and cap facets come from the arena
+struct stl_cap_worker {
+  stl_arena arena;
+  std::vector<p2t::Point*> polygon;
+  std::vector<std::vector<p2t::Point*> > holes;
+};
+
+// scratch buffers of the loop assembly and the cap triangulation
+struct stl_cap_buffers {
+  stl_id_table unique; // unique_border()
+  std::vector<stl_vertex_pair> border2d;
+  stl_loops loops;
+  // border points sharing a 2D point with a different 3D one, (point, the one used)
+  std::vector<stl_vertex_pair> welds;
+  stl_id_table moves; // weld_seam(), ids of the welds by the point moved
+  // assemble_loops()
+  stl_id_table ids; // ids of the points
+  std::vector<stl_vertex> points;
+  std::vector<stl_vertex> seam;
+  std::vector<int> ends;
+  std::vector<int> first;
+  std::vector<int> incident;
+  std::vector<int> filled;
+  std::vector<bool> used;
+  std::vector<int> next;
+  // nest_loops(), group g is the outer loop group_loops[group_starts[g]] and its holes after it
+  std::vector<double> areas;
+  std::vector<int> parents;
+  std::vector<stl_sweep_edge> sweep_edges;
+  std::vector<stl_sweep_event> sweep_events;
+  stl_arena sweep_arena;
+  std::vector<stl_sweep_set::iterator> sweep_positions; // of the edges in the sweep set
+  std::vector<int> depths;
+  std::vector<int> groups;
+  std::vector<size_t> group_sizes;
+  std::vector<size_t> group_filled;
+  std::vector<int> group_loops;
+  std::vector<size_t> group_starts;
+  // triangulate_groups()
+  std::vector<stl_cap_worker> workers;
+  std::vector<stl_facet*> group_upper; // cap facets of a group, in the arena of the worker
+  std::vector<stl_facet*> group_lower;
+  std::vector<size_t> group_facets;
+};
+
+// triangulates one outer loop with its holes on the plane
+// the cap facets for the upper and lower part are allocated from the arena of the worker,
+// returns their number
+// the cap gets the 3D border points themselves, so it shares the vertices of the cut facets exactly
+size_t triangulate_group(const stl_loops &loops, const int* ids, size_t count, stl_plane plane,
+                         stl_cap_worker &worker, stl_facet* &upper, stl_facet* &lower) {
+  size_t length = 0;
+  for (size_t k = 0; k < count; k++)
+    length += loops.length(ids[k]);
+  p2t::Point* points = worker.arena.allocate<p2t::Point>(length);
+  stl_vertex* seam = worker.arena.allocate<stl_vertex>(length); // 3D border point of every point
+  if (worker.holes.size() < count) worker.holes.resize(count);
+  size_t n = 0;
+  for (size_t k = 0; k < count; k++) {
+    std::vector<p2t::Point*> &polyline = k ? worker.holes[k-1] : worker.polygon;
+    polyline.clear();
+    const stl_vertex* loop = loops.loop(ids[k]);
+    const stl_vertex* loop_seam = loops.loop_seam(ids[k]);
+    for (size_t i = 0; i < loops.length(ids[k]); i++, n++) {
+      new (points + n) p2t::Point(loop[i].x, loop[i].y);
+      seam[n] = loop_seam[i];
+      polyline.push_back(points + n);
+    }
+  }
+  
+  size_t facets;
+  {
+    // triangulate
+    p2t::CDT cdt(worker.polygon);
+    for (size_t k = 1; k < count; k++)
+      cdt.AddHole(worker.holes[k-1]);
+    cdt.Triangulate();
+    std::vector<p2t::Triangle*> triangles = cdt.GetTriangles();
+    facets = triangles.size();
+    upper = worker.arena.allocate<stl_facet>(facets);
+    lower = worker.arena.allocate<stl_facet>(facets);
+    
+    // for each triangle, create facet
+    for (size_t i = 0; i < facets; i++) {
+      stl_vertex vertex;
+      stl_facet facet;
+      facet.extra[0] = facet.extra[1] = 0;
+      for (size_t j = 0; j < 3; j++) {
+        p2t::Point* p = triangles[i]->GetPoint(j);
+        facet.vertex[j] = seam[p - points];
+      }
+      // normal goes out of the object, for lower part, it is identical to plane normal
+      facet.normal.x = plane.x;
+      facet.normal.y = plane.y;
+      facet.normal.z = plane.z;
+      lower[i] = facet;
+      
+      // for the upper part, we need to invert the normal...
+      facet.normal.x = -plane.x;
+      facet.normal.y = -plane.y;
+      facet.normal.z = -plane.z;
+      // ...and reverse the order of the vertices
+      // TODO check if the order of vertices from poly2tri in fact depends on orientation of the first used edge
+      // .. and the order might be reversed anyway
+      vertex = facet.vertex[1];
+      facet.vertex[1] = facet.vertex[2];
+      facet.vertex[2] = vertex;
+      upper[i] = facet;
+    }
+  }
+  
+  // the CDT is gone, the points may keep memory of their own
+  for (size_t i = 0; i < length; i++)
+    points[i].~Point();
+  return facets;
+}
+
+// 2D border point quantized to the bit patterns of its coordinates
+// shared border points are bitwise identical thanks to the intersection cache
+struct stl_point_key {
+  unsigned x;
+  unsigned y;
+  
+  stl_point_key(stl_vertex vertex) {
+    // + 0.0f turns -0 to 0
+    float fx = vertex.x + 0.0f;
+    float fy = vertex.y + 0.0f;
+    memcpy(&x, &fx, sizeof(unsigned));
+    memcpy(&y, &fy, sizeof(unsigned));
+  }
+  
+  bool operator==(const stl_point_key& other) const {
+    return x == other.x && y == other.y;
+  }
+};
+
+struct stl_point_key_hash {
+  size_t operator()(const stl_point_key& key) const {
+    return ((size_t)key.x * 0x9e3779b97f4a7c15ULL) ^ key.y;
+  }
+};
+
+// assembles closed polylines from unordered 2D border edges in linear time
+// every distinct point gets an id and the edges incident to each point are listed,
+// walking a loop then only looks at the edges of its current end point
+// the closing point isn't repeated, poly2tri doesn't like this
+// edges3d are the same edges in 3D, a 2D point keeps the first 3D point it comes from
+// and the other 3D points falling to it are listed in welds
+void assemble_loops(const std::vector<stl_vertex_pair> &edges, const std::vector<stl_vertex_pair> &edges3d,
+                    stl_loops &loops, stl_cap_buffers &buffers) {
+  stl_id_table &ids = buffers.ids;
+  ids.clear(edges.size()*2);
+  stl_point_key_hash hash;
+  std::vector<stl_vertex> &points = buffers.points;
+  std::vector<stl_vertex> &seam = buffers.seam;
+  std::vector<int> &ends = buffers.ends;
+  points.clear();
+  seam.clear();
+  buffers.welds.clear();
+  ends.resize(edges.size()*2);
+  for (size_t i = 0; i < edges.size(); i++) {
+    for (size_t j = 0; j < 2; j++) {
+      stl_vertex point = j ? edges[i].y : edges[i].x;
+      stl_vertex point3d = j ? edges3d[i].y : edges3d[i].x;
+      stl_point_key key(point);
+      size_t slot = ids.first(hash(key));
+      while (ids.slots[slot] >= 0 && !(stl_point_key(points[ids.slots[slot]]) == key))
+        slot = ids.next(slot);
+      int id = ids.slots[slot];
+      if (id < 0) {
+        id = ids.slots[slot] = points.size();
+        points.push_back(point);
+        seam.push_back(point3d);
+      } else if (memcmp(&seam[id], &point3d, sizeof(stl_vertex))) {
+        buffers.welds.push_back(stl_vertex_pair(point3d, seam[id]));
+      }
+      ends[2*i+j] = id;
+    }
+  }
+  
+  // edges incident to each point, as offsets to one flat array
+  std::vector<int> &first = buffers.first;
+  first.assign(points.size()+1, 0);
+  for (size_t i = 0; i < ends.size(); i++) first[ends[i]+1]++;
+  for (size_t i = 0; i < points.size(); i++) first[i+1] += first[i];
+  std::vector<int> &incident = buffers.incident;
+  incident.resize(ends.size());
+  std::vector<int> &filled = buffers.filled;
+  filled.assign(first.begin(), first.end()-1);
+  for (size_t i = 0; i < ends.size(); i++) incident[filled[ends[i]]++] = i/2;
+  
+  // edges collapsed to a single point (cut right next to a vertex) are left out
+  std::vector<bool> &used = buffers.used;
+  used.assign(edges.size(), false);
+  for (size_t e = 0; e < edges.size(); e++)
+    if (ends[2*e] == ends[2*e+1]) used[e] = true;
+  std::vector<int> &next = buffers.next; // incident edges already looked at
+  next.assign(points.size(), 0);
+  loops.clear();
+  loops.starts.push_back(0);
+  for (size_t e = 0; e < edges.size(); e++) {
+    if (used[e]) continue;
+    used[e] = true;
+    int start = ends[2*e];
+    int current = ends[2*e+1];
+    loops.points.push_back(points[start]);
+    loops.seam.push_back(seam[start]);
+    while (current != start) {
+      loops.points.push_back(points[current]);
+      loops.seam.push_back(seam[current]);
+      int edge = -1;
+      while (first[current] + next[current] < first[current+1]) {
+        int candidate = incident[first[current] + next[current]++];
+        if (!used[candidate]) {
+          edge = candidate;
+          break;
+        }
+      }
+      // the loop isn't closed, the mesh is broken
+      if (edge < 0) break;
+      used[edge] = true;
+      current = ends[2*edge] == current ? ends[2*edge+1] : ends[2*edge];
+    }
+    loops.starts.push_back(loops.points.size());
+  }
+}
+
+// twice the signed area of the loop
+double loop_area(const stl_vertex* loop, size_t length) {
+  double area = 0;
+  for (size_t i = 0, j = length - 1; i < length; j = i++)
+    area += (double)loop[j].x*loop[i].y - (double)loop[i].x*loop[j].y;
+  return area;
+}
+
+// groups the loops to outer loops and their holes
+// loops inside an even number of loops are outer, the rest are holes of the loop right around them
+// loops with less than 3 points are left out
+// the loops don't cross, so one sweep from left to right nests them all in O(n log n):
+// the first edge above the leftmost point of a loop either has the inside of its loop below,
+// then the loop is in that one, or it doesn't and the loop is a sibling of that one
+void nest_loops(const stl_loops &loops, stl_cap_buffers &buffers) {
+  size_t count = loops.size();
+  std::vector<double> &areas = buffers.areas;
+  std::vector<int> &parents = buffers.parents;
+  std::vector<stl_sweep_edge> &edges = buffers.sweep_edges;
+  std::vector<stl_sweep_event> &events = buffers.sweep_events;
+  areas.resize(count);
+  parents.assign(count, -1);
+  edges.clear();
+  events.clear();
+  for (size_t i = 0; i < count; i++) {
+    size_t length = loops.length(i);
+    if (length < 3) continue;
+    const stl_vertex* loop = loops.loop(i);
+    areas[i] = loop_area(loop, length);
+    size_t leftmost = 0;
+    for (size_t k = 0; k < length; k++) {
+      if (loop[k].x < loop[leftmost].x || (loop[k].x == loop[leftmost].x && loop[k].y < loop[leftmost].y))
+        leftmost = k;
+      stl_vertex a = loop[k], b = loop[(k+1) % length];
+      // vertical edges are never the first edge above a point
+      if (a.x == b.x) continue;
+      stl_sweep_edge edge;
+      edge.loop = i;
+      // counterclockwise loops have the inside on the left of their edges
+      edge.top = (a.x > b.x) == (areas[i] > 0);
+      if (a.x > b.x) std::swap(a, b);
+      edge.x0 = a.x; edge.y0 = a.y;
+      edge.x1 = b.x; edge.y1 = b.y;
+      stl_sweep_event event;
+      event.id = edges.size();
+      event.x = a.x; event.y = a.y; event.type = sweep_insert;
+      events.push_back(event);
+      event.x = b.x; event.y = b.y; event.type = sweep_remove;
+      events.push_back(event);
+      edges.push_back(edge);
+    }
+    stl_sweep_event event;
+    event.x = loop[leftmost].x; event.y = loop[leftmost].y; event.type = sweep_query; event.id = i;
+    events.push_back(event);
+  }
+  std::sort(events.begin(), events.end());
+  
+  // the set of the last call is gone, its nodes can be handed out again
+  buffers.sweep_arena.release();
+  double x = 0, query = 0;
+  stl_sweep_set active(stl_sweep_less(edges, x, query), stl_arena_allocator<int>(&buffers.sweep_arena));
+  std::vector<stl_sweep_set::iterator> &positions = buffers.sweep_positions;
+  positions.resize(edges.size());
+  std::vector<int> &depth = buffers.depths;
+  depth.assign(count, 0);
+  for (std::vector<stl_sweep_event>::iterator event = events.begin(); event != events.end(); event++) {
+    x = event->x;
+    if (event->type == sweep_remove) {
+      active.erase(positions[event->id]);
+    } else if (event->type == sweep_insert) {
+      positions[event->id] = active.insert(event->id).first;
+    } else {
+      int i = event->id;
+      query = event->y;
+      stl_sweep_set::iterator above = active.lower_bound(-1);
+      // edges of the loop itself can only start at its leftmost x, like the top of a rectangle
+      while (above != active.end() && edges[*above].loop == i) above++;
+      if (above == active.end()) continue;
+      const stl_sweep_edge &edge = edges[*above];
+      if (edge.top) {
+        parents[i] = edge.loop;
+        depth[i] = depth[edge.loop] + 1;
+      } else {
+        parents[i] = parents[edge.loop];
+        depth[i] = depth[edge.loop];
+      }
+    }
+  }
+  
+  // outer loops in order, each followed by its holes
+  std::vector<int> &group_loops = buffers.group_loops;
+  std::vector<size_t> &group_starts = buffers.group_starts;
+  group_loops.clear();
+  group_starts.clear();
+  std::vector<int> &group = buffers.groups;
+  group.assign(count, -1);
+  for (size_t i = 0; i < count; i++) {
+    if (loops.length(i) < 3 || depth[i] % 2) continue;
+    group[i] = group_starts.size();
+    group_starts.push_back(0);
+  }
+  std::vector<size_t> &sizes = buffers.group_sizes;
+  sizes.assign(group_starts.size(), 1);
+  for (size_t i = 0; i < count; i++)
+    if (loops.length(i) >= 3 && depth[i] % 2) sizes[group[parents[i]]]++;
+  size_t start = 0;
+  for (size_t g = 0; g < sizes.size(); g++) {
+    group_starts[g] = start;
+    start += sizes[g];
+  }
+  group_starts.push_back(start);
+  group_loops.resize(start);
+  // the outer loop goes first whatever its index, triangulate_group() takes it for the polygon
+  std::vector<size_t> &filled = buffers.group_filled;
+  filled.assign(group_starts.begin(), group_starts.end() - 1);
+  for (size_t i = 0; i < count; i++) {
+    if (loops.length(i) < 3) continue;
+    if (depth[i] % 2) group_loops[++filled[group[parents[i]]]] = i;
+    else group_loops[group_starts[group[i]]] = i;
+  }
+}
+
+// triangulates the groups of one thread, taking the next group not yet taken
+void triangulate_groups(const stl_loops* loops, stl_cap_buffers* buffers, stl_plane plane,
+                        std::atomic<int>* next, int worker) {
+  stl_cap_worker &out = buffers->workers[worker];
+  int groups = buffers->group_starts.size() - 1;
+  for (int g = (*next)++; g < groups; g = (*next)++) {
+    size_t first = buffers->group_starts[g];
+    buffers->group_facets[g] = triangulate_group(*loops, &buffers->group_loops[first],
+                                                 buffers->group_starts[g+1] - first, plane, out,
+                                                 buffers->group_upper[g], buffers->group_lower[g]);
+  }
+}
+
+// removes repeated border edges, keeping the first of them
+// an edge lying on the plane comes from the facets on both sides
+void unique_border(std::vector<stl_vertex_pair> &border, stl_cap_buffers &buffers) {
+  stl_id_table &unique = buffers.unique; // ids of the kept edges
+  unique.clear(border.size());
+  stl_vertex_pair_hash hash;
+  size_t kept = 0;
+  for (size_t i = 0; i < border.size(); i++) {
+    size_t slot = unique.first(hash(border[i]));
+    while (unique.slots[slot] >= 0 && !(border[unique.slots[slot]] == border[i]))
+      slot = unique.next(slot);
+    if (unique.slots[slot] >= 0) continue;
+    unique.slots[slot] = kept;
+    border[kept++] = border[i];
+  }
+  border.erase(border.begin() + kept, border.end());
+}
+
+// sorts the border edges to loops in the buffers, the welds of the seam are known then
+// returns false if there are no edges, there are no loops and welds then
+bool stitch_border(std::vector<stl_vertex_pair> &border, stl_plane plane,
+                   stl_cap_buffers &buffers, stl_report &report) {
+  // the plane misses the mesh, nothing of a previous cut may be welded
+  if (border.empty()) {
+    buffers.loops.clear();
+    buffers.welds.clear();
+    return false;
+  }
+  
+  report.start();
+  unique_border(border, buffers);
+  std::vector<stl_vertex_pair> &border2d = buffers.border2d;
+  border2d.clear();
+  border2d.reserve(border.size());
+  
+  // transform the border points coordinates to 2D
+  stl_vertex origin = border[0].x;
+  for (std::vector<stl_vertex_pair>::iterator i = border.begin(); i != border.end(); i++) {
+    stl_vertex x = plane.to_2D((*i).x, origin);
+    stl_vertex y = plane.to_2D((*i).y, origin);
+    border2d.push_back(stl_vertex_pair(x,y));
+  }
+  report.border_edges += border2d.size();
+  report.stop("border");
+  
+  // sort the edges to make polygons
+  report.start();
+  stl_loops &loops = buffers.loops;
+  assemble_loops(border2d, border, loops, buffers);
+  report.loops += loops.size();
+  report.stop("stitch");
+  return true;
+}
+
+// triangulates the loops stitched by stitch_border()
+// and adds the cap facets to both upper and lower part
+// every outer loop with its holes is a separate polygon, the polygons are triangulated
+// by up to given number of threads and the facets are added in the order of the loops
+void triangulate_loops(stl_plane plane, std::vector<stl_facet> &upper, std::vector<stl_facet> &lower,
+                       stl_cap_buffers &buffers, int threads, stl_report &report) {
+  stl_loops &loops = buffers.loops;
+  report.start();
+  nest_loops(loops, buffers);
+  int groups = buffers.group_starts.size() - 1;
+  threads = STL_MIN(threads, STL_MIN(groups, (int)(loops.points.size() / CAP_THREAD_MIN_POINTS)));
+  threads = STL_MAX(threads, 1);
+  if ((int)buffers.workers.size() < threads) buffers.workers.resize(threads);
+  buffers.group_upper.resize(groups);
+  buffers.group_lower.resize(groups);
+  buffers.group_facets.resize(groups);
+  std::atomic<int> next(0);
+  if (threads == 1) {
+    triangulate_groups(&loops, &buffers, plane, &next, 0);
+  } else {
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++)
+      workers.push_back(std::thread(triangulate_groups, &loops, &buffers, plane, &next, t));
+    for (int t = 0; t < threads; t++)
+      workers[t].join();
+  }
+  
+  size_t cap_facets = lower.size();
+  for (int g = 0; g < groups; g++) {
+    upper.insert(upper.end(), buffers.group_upper[g], buffers.group_upper[g] + buffers.group_facets[g]);
+    lower.insert(lower.end(), buffers.group_lower[g], buffers.group_lower[g] + buffers.group_facets[g]);
+  }
+  
+  // the cap is out, all of its memory goes back at once
+  for (int t = 0; t < threads; t++) {
+    stl_arena &arena = buffers.workers[t].arena;
+    report.cap_allocations += arena.allocations;
+    report.cap_mallocs += arena.mallocs;
+    arena.allocations = arena.mallocs = 0;
+    arena.release();
+  }
+  report.cap_facets += lower.size() - cap_facets;
+  report.stop("triangulate");
+}
+
+// triangulates the hole given by border edges
+// and adds the cap facets to both upper and lower part
+void triangulate_border(std::vector<stl_vertex_pair> &border, stl_plane plane,
+                        std::vector<stl_facet> &upper, std::vector<stl_facet> &lower,
+                        stl_cap_buffers &buffers, int threads, stl_report &report) {
+  if (stitch_border(border, plane, buffers, report))
+    triangulate_loops(plane, upper, lower, buffers, threads, report);
+}
+
+// vertex classification kernels
+// they work on structure of arrays copies of the vertices and evaluate the plane exactly
+// like stl_plane::position (in doubles, in the same order and without fused multiply-add),
+// so the result doesn't depend on the kernel used
+// count has to be a multiple of CLASSIFY_WIDTH, the arrays are padded
+typedef void (*classify_kernel)(const float* x, const float* y, const float* z, int count,
+                                stl_plane plane, unsigned char* pos);
+
+void classify_scalar(const float* x, const float* y, const float* z, int count,
+                     stl_plane plane, unsigned char* pos) {
+  for (int i = 0; i < count; i++) {
+    double result = (double)plane.x*x[i] + (double)plane.y*y[i] + (double)plane.z*z[i] + plane.d;
+    pos[i] = result > 0 ? above : (result < 0 ? below : on);
+  }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+// positions of 4 vertices given the above and below sign masks, one byte each
+struct classify_lanes {
+  unsigned table[256];
+  classify_lanes() {
+    for (unsigned aboves = 0; aboves < 16; aboves++) {
+      for (unsigned belows = 0; belows < 16; belows++) {
+        unsigned lanes = 0;
+        for (unsigned j = 0; j < 4; j++) {
+          unsigned pos = (aboves >> j & 1) ? above : ((belows >> j & 1) ? below : on);
+          lanes |= pos << 8*j;
+        }
+        table[aboves | belows << 4] = lanes;
+      }
+    }
+  }
+};
+static const classify_lanes lanes;
+
+__attribute__((target("avx2")))
+void classify_avx2(const float* x, const float* y, const float* z, int count,
+                   stl_plane plane, unsigned char* pos) {
+  __m256d px = _mm256_set1_pd(plane.x);
+  __m256d py = _mm256_set1_pd(plane.y);
+  __m256d pz = _mm256_set1_pd(plane.z);
+  __m256d pd = _mm256_set1_pd(plane.d);
+  __m256d zero = _mm256_setzero_pd();
+  for (int i = 0; i < count; i += 4) {
+    __m256d r = _mm256_mul_pd(px, _mm256_cvtps_pd(_mm_loadu_ps(x+i)));
+    r = _mm256_add_pd(r, _mm256_mul_pd(py, _mm256_cvtps_pd(_mm_loadu_ps(y+i))));
+    r = _mm256_add_pd(r, _mm256_mul_pd(pz, _mm256_cvtps_pd(_mm_loadu_ps(z+i))));
+    r = _mm256_add_pd(r, pd);
+    unsigned aboves = _mm256_movemask_pd(_mm256_cmp_pd(r, zero, _CMP_GT_OQ));
+    unsigned belows = _mm256_movemask_pd(_mm256_cmp_pd(r, zero, _CMP_LT_OQ));
+    memcpy(pos+i, &lanes.table[aboves | belows << 4], 4);
+  }
+}
+
+__attribute__((target("avx512f")))
+void classify_avx512(const float* x, const float* y, const float* z, int count,
+                     stl_plane plane, unsigned char* pos) {
+  __m512d px = _mm512_set1_pd(plane.x);
+  __m512d py = _mm512_set1_pd(plane.y);
+  __m512d pz = _mm512_set1_pd(plane.z);
+  __m512d pd = _mm512_set1_pd(plane.d);
+  __m512d zero = _mm512_setzero_pd();
+  // the zero masked conversion of all lanes, _mm512_cvtps_pd() starts from an undefined vector
+  // and GCC warns about it being used uninitialized
+  const __mmask8 all = 0xff;
+  for (int i = 0; i < count; i += 8) {
+    __m512d r = _mm512_mul_pd(px, _mm512_maskz_cvtps_pd(all, _mm256_loadu_ps(x+i)));
+    r = _mm512_add_pd(r, _mm512_mul_pd(py, _mm512_maskz_cvtps_pd(all, _mm256_loadu_ps(y+i))));
+    r = _mm512_add_pd(r, _mm512_mul_pd(pz, _mm512_maskz_cvtps_pd(all, _mm256_loadu_ps(z+i))));
+    r = _mm512_add_pd(r, pd);
+    unsigned aboves = _mm512_cmp_pd_mask(r, zero, _CMP_GT_OQ);
+    unsigned belows = _mm512_cmp_pd_mask(r, zero, _CMP_LT_OQ);
+    memcpy(pos+i, &lanes.table[(aboves & 15) | (belows & 15) << 4], 4);
+    memcpy(pos+i+4, &lanes.table[aboves >> 4 | (belows >> 4) << 4], 4);
+  }
+}
+
+// picks the widest kernel the CPU supports
+classify_kernel select_classify() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return classify_avx512;
+  if (__builtin_cpu_supports("avx2")) return classify_avx2;
+  return classify_scalar;
+}
+#else
+classify_kernel select_classify() {
+  return classify_scalar;
+}
+#endif
+
+static const classify_kernel classify = select_classify();
+
+// packed per facet case codes, 2 bits per vertex position
+#define CASE_CODE(a, b, c) ((a) | (b) << 2 | (c) << 4)
+#define CASE_ABOVE CASE_CODE(above, above, above)
+#define CASE_BELOW CASE_CODE(below, below, below)
+
+// facets classified at once, vertex arrays are padded to the widest kernel
+#define CLASSIFY_BLOCK 1024
+#define CLASSIFY_WIDTH 8
+
+// plain array of facets with the same interface as stl_input
+struct stl_facet_array {
+  const stl_facet* facets;
+  stl_facet_array(const stl_facet* facets) {
+    this->facets = facets;
+  }
+  stl_facet facet(int i) const {
+    return facets[i];
+  }
+};
+
+// output of one separating thread
+// the block buffers are kept for the next cut
+struct stl_separated {
+  std::vector<stl_facet> upper;
+  std::vector<stl_facet> lower;
+  std::vector<int> upper_pieces; // indices of the pieces of cut facets
+  std::vector<int> lower_pieces;
+  std::vector<stl_vertex_pair> border; // may have duplicates
+  stl_intersection_cache cache;
+  stl_case_counts counts;
+  std::vector<stl_facet> block;
+  std::vector<float> x, y, z;
+  std::vector<unsigned char> pos;
+  
+  // empties the output, keeping the memory of the vectors
+  void clear() {
+    upper.clear();
+    lower.clear();
+    upper_pieces.clear();
+    lower_pieces.clear();
+    border.clear();
+    cache.clear();
+    counts = stl_case_counts();
+  }
+  
+  // empties the parts once written, the border stays for the cap
+  void clear_parts() {
+    upper.clear();
+    lower.clear();
+    upper_pieces.clear();
+    lower_pieces.clear();
+  }
+  
+  // separates a facet the plane may go through, remembering where the pieces are
+  void cut(const stl_facet &facet, stl_plane plane, const stl_position pos[3]) {
+    size_t u = upper.size(), l = lower.size();
+    separate(facet, plane, pos, upper, lower, border, cache, counts);
+    for (; u < upper.size(); u++) upper_pieces.push_back(u);
+    for (; l < lower.size(); l++) lower_pieces.push_back(l);
+  }
+  
+  void cut(const stl_facet &facet, stl_plane plane) {
+    stl_position pos[3];
+    for (size_t i = 0; i < 3; i++)
+      pos[i] = plane.position(facet.vertex[i]);
+    cut(facet, plane, pos);
+  }
+};
+
+// slot of the weld moving the vertex in cap.moves, or the empty slot it would take
+// the point is hashed twice to use the pair hash
+size_t weld_slot(const stl_cap_buffers &cap, const stl_vertex &vertex) {
+  const stl_id_table &moves = cap.moves;
+  size_t slot = moves.first(stl_vertex_pair_hash()(stl_vertex_pair(vertex, vertex)));
+  while (moves.slots[slot] >= 0 && memcmp(&cap.welds[moves.slots[slot]].x, &vertex, sizeof(stl_vertex)))
+    slot = moves.next(slot);
+  return slot;
+}
+
+// moves the vertices of the pieces to the 3D points the cap uses,
+// where more border points fell to one point on the plane
+// nothing but the pieces is looked at
+void weld_seam(stl_separated &out, stl_cap_buffers &cap) {
+  if (cap.welds.empty()) return;
+  cap.moves.clear(cap.welds.size());
+  for (size_t i = 0; i < cap.welds.size(); i++)
+    cap.moves.slots[weld_slot(cap, cap.welds[i].x)] = i;
+  for (size_t k = 0; k < 2; k++) {
+    std::vector<stl_facet> &facets = k ? out.lower : out.upper;
+    std::vector<int> &pieces = k ? out.lower_pieces : out.upper_pieces;
+    for (std::vector<int>::iterator i = pieces.begin(); i != pieces.end(); i++) {
+      for (size_t j = 0; j < 3; j++) {
+        stl_vertex &vertex = facets[*i].vertex[j];
+        int move = cap.moves.slots[weld_slot(cap, vertex)];
+        if (move >= 0) vertex = cap.welds[move].y;
+      }
+    }
+  }
+}
+
+// returns 1 if all facets are above the plane, -1 if all are below and 0 otherwise
+// the plane position is monotonic in every coordinate, even rounded,
+// so it's enough to check the corner of the bounding box closest to the plane
+int block_side(const stl_facet* facets, int count, stl_plane plane) {
+  stl_vertex min = facets[0].vertex[0], max = min;
+  for (int i = 0; i < count; i++) {
+    for (size_t j = 0; j < 3; j++) {
+      const stl_vertex &v = facets[i].vertex[j];
+      min.x = STL_MIN(min.x, v.x); max.x = STL_MAX(max.x, v.x);
+      min.y = STL_MIN(min.y, v.y); max.y = STL_MAX(max.y, v.y);
+      min.z = STL_MIN(min.z, v.z); max.z = STL_MAX(max.z, v.z);
+    }
+  }
+  stl_vertex lowest, highest;
+  lowest.x = plane.x > 0 ? min.x : max.x; highest.x = plane.x > 0 ? max.x : min.x;
+  lowest.y = plane.y > 0 ? min.y : max.y; highest.y = plane.y > 0 ? max.y : min.y;
+  lowest.z = plane.z > 0 ? min.z : max.z; highest.z = plane.z > 0 ? max.z : min.z;
+  if (plane.position(lowest) == above) return 1;
+  if (plane.position(highest) == below) return -1;
+  return 0;
+}
+
+// separates facets from begin to end
+// vertices are classified block by block with the vector kernel,
+// only facets not wholly above or below the plane go to separate()
+template <class stl_facets>
+void separate_range(const stl_facets &facets, int begin, int end, stl_plane plane, stl_separated &out) {
+  const size_t size = 3*CLASSIFY_BLOCK + CLASSIFY_WIDTH;
+  if (out.pos.size() < size) {
+    out.block.resize(CLASSIFY_BLOCK);
+    out.x.assign(size, 0);
+    out.y.assign(size, 0);
+    out.z.assign(size, 0);
+    out.pos.resize(size);
+  }
+  std::vector<stl_facet> &block = out.block;
+  std::vector<float> &x = out.x, &y = out.y, &z = out.z;
+  std::vector<unsigned char> &pos = out.pos;
+  std::vector<stl_facet> &upper = out.upper, &lower = out.lower;
+  stl_case_counts &counts = out.counts;
+  
+  for (int first = begin; first < end; first += CLASSIFY_BLOCK) {
+    int count = STL_MIN(CLASSIFY_BLOCK, end - first);
+    for (int i = 0; i < count; i++) {
+      block[i] = facets.facet(first + i);
+      for (size_t j = 0; j < 3; j++) {
+        x[3*i+j] = block[i].vertex[j].x;
+        y[3*i+j] = block[i].vertex[j].y;
+        z[3*i+j] = block[i].vertex[j].z;
+      }
+    }
+    
+    // blocks away from the plane are copied whole
+    int side = block_side(&block[0], count, plane);
+    if (side != 0) {
+      std::vector<stl_facet> &part = side > 0 ? upper : lower;
+      part.insert(part.end(), block.begin(), block.begin() + count);
+      counts[side > 0 ? case_above : case_below] += count;
+      continue;
+    }
+    
+    int vertices = 3*count;
+    classify(&x[0], &y[0], &z[0], vertices + (CLASSIFY_WIDTH - vertices % CLASSIFY_WIDTH) % CLASSIFY_WIDTH,
+             plane, &pos[0]);
+    
+    for (int i = 0; i < count; i++) {
+      const unsigned char* p = &pos[3*i];
+      int code = CASE_CODE(p[0], p[1], p[2]);
+      if (code == CASE_ABOVE) {
+        counts[case_above]++;
+        upper.push_back(block[i]);
+      } else if (code == CASE_BELOW) {
+        counts[case_below]++;
+        lower.push_back(block[i]);
+      } else {
+        stl_position facet_pos[3] = { (stl_position)p[0], (stl_position)p[1], (stl_position)p[2] };
+        out.cut(block[i], plane, facet_pos);
+      }
+    }
+  }
+}
+
+// separates all facets using up to given number of threads
+// every thread takes a contiguous range and the results are appended in the range order,
+// so the output is the same for any number of threads
+// the parts of the threads are emptied after the merge but keep their memory
+template <class stl_facets>
+void separate_all(const stl_facets &facets, int count, stl_plane plane, int threads,
+                  stl_separated &out, std::vector<stl_separated> &parts) {
+  threads = STL_MIN(threads, count / THREAD_MIN_FACETS);
+  if (threads <= 1) {
+    separate_range(facets, 0, count, plane, out);
+    return;
+  }
+  
+  if ((int)parts.size() < threads) parts.resize(threads);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    int begin = (long)count*t/threads;
+    int end = (long)count*(t+1)/threads;
+    workers.push_back(std::thread(separate_range<stl_facets>, std::cref(facets), begin, end, plane,
+                                  std::ref(parts[t])));
+  }
+  for (int t = 0; t < threads; t++) {
+    workers[t].join();
+    stl_separated &part = parts[t];
+    for (std::vector<int>::iterator i = part.upper_pieces.begin(); i != part.upper_pieces.end(); i++)
+      out.upper_pieces.push_back(out.upper.size() + *i);
+    for (std::vector<int>::iterator i = part.lower_pieces.begin(); i != part.lower_pieces.end(); i++)
+      out.lower_pieces.push_back(out.lower.size() + *i);
+    out.upper.insert(out.upper.end(), part.upper.begin(), part.upper.end());
+    out.lower.insert(out.lower.end(), part.lower.begin(), part.lower.end());
+    out.border.insert(out.border.end(), part.border.begin(), part.border.end());
+    out.counts.add(part.counts);
+    part.clear();
+  }
+}
+
+// triangle of an indexed mesh, the normal and the extra bytes come from the original facet
+struct stl_triangle {
+  int vertex[3];
+  stl_normal normal;
+  char extra[2];
+};
+
+// mesh with every distinct vertex stored once
+struct stl_indexed_mesh {
+  std::vector<stl_vertex> vertices;
+  std::vector<stl_triangle> triangles;
+};
+
+// vertex quantized to the bit patterns of its coordinates
+struct stl_vertex_key {
+  unsigned bits[3];
+  
+  stl_vertex_key(stl_vertex vertex) {
+    memcpy(bits, &vertex, sizeof(bits));
+  }
+  
+  bool operator==(const stl_vertex_key& other) const {
+    return bits[0] == other.bits[0] && bits[1] == other.bits[1] && bits[2] == other.bits[2];
+  }
+};
+
+struct stl_vertex_key_hash {
+  size_t operator()(const stl_vertex_key& key) const {
+    size_t hash = 0;
+    for (size_t i = 0; i < 3; i++)
+      hash = (hash ^ key.bits[i]) * 0x100000001b3ULL;
+    return hash ^ (hash >> 29);
+  }
+};
+
+// welds bitwise identical vertices of the facets to one
+// open addressing over vertex ids, the table is at least 4/3 of the vertex count
+template <class stl_facets>
+void index_facets(const stl_facets &facets, int count, stl_indexed_mesh &mesh, std::vector<int> &table) {
+  size_t size = 1;
+  while (size < 4 * (size_t)count) size <<= 1;
+  table.assign(size, -1);
+  stl_vertex_key_hash hash;
+  mesh.vertices.clear();
+  mesh.triangles.resize(count);
+  for (int i = 0; i < count; i++) {
+    stl_facet facet = facets.facet(i);
+    stl_triangle &triangle = mesh.triangles[i];
+    for (size_t j = 0; j < 3; j++) {
+      stl_vertex_key key(facet.vertex[j]);
+      size_t slot = hash(key) & (size - 1);
+      while (table[slot] >= 0 && !(stl_vertex_key(mesh.vertices[table[slot]]) == key))
+        slot = (slot + 1) & (size - 1);
+      if (table[slot] < 0) {
+        table[slot] = mesh.vertices.size();
+        mesh.vertices.push_back(facet.vertex[j]);
+      }
+      triangle.vertex[j] = table[slot];
+    }
+    triangle.normal = facet.normal;
+    triangle.extra[0] = facet.extra[0];
+    triangle.extra[1] = facet.extra[1];
+  }
+}
+
+// parts of an indexed mesh, sharing one vertex array
+// the vertices of the mesh come first, then the intersections of the edges with the plane
+struct stl_indexed_cut {
+  std::vector<stl_vertex> vertices;
+  std::vector<stl_triangle> upper;
+  std::vector<stl_triangle> lower;
+  std::vector<int> border; // two vertices per edge
+  stl_case_counts counts;
+  // vertex classification
+  std::vector<float> x, y, z;
+  std::vector<unsigned char> pos;
+  // edge (lower vertex, higher vertex) of every intersection and the table of them
+  std::vector<unsigned long long> edges;
+  size_t first_intersection; // vertex of the first intersection
+  stl_id_table intersections;
+  // cap
+  std::vector<stl_vertex_pair> seam;
+  std::vector<stl_facet> cap_upper, cap_lower;
+  // seam points with their vertices, the first vertex at a point is the one the cap uses
+  // the points are kept apart, the welds replace the vertices
+  std::vector<stl_vertex> seam_points;
+  std::vector<int> seam_vertices;
+  stl_id_table seam_ids;
+  // vertex replacing each seam vertex at the point of another or welded to the cap, -1 if kept
+  std::vector<int> moves;
+  size_t moved;
+  std::vector<int> table; // for index_facets()
+  
+  // slot of the point in the seam ids, or the empty slot it would take
+  size_t seam_slot(stl_vertex vertex) const {
+    stl_vertex_key key(vertex);
+    size_t slot = seam_ids.first(stl_vertex_key_hash()(key));
+    while (seam_ids.slots[slot] >= 0 && !(stl_vertex_key(seam_points[seam_ids.slots[slot]]) == key))
+      slot = seam_ids.next(slot);
+    return slot;
+  }
+  
+  // a vertex at the point of an earlier one is replaced by it,
+  // intersections of different edges can be the same point
+  void add_seam(int id) {
+    size_t slot = seam_slot(vertices[id]);
+    int i = seam_ids.slots[slot];
+    if (i >= 0) {
+      if (seam_vertices[i] != id && moves[id] < 0) {
+        moves[id] = seam_vertices[i];
+        moved++;
+      }
+      return;
+    }
+    if (seam_ids.full(seam_points.size())) {
+      seam_ids.clear(2 * (seam_points.size() + 1));
+      for (size_t i = 0; i < seam_points.size(); i++)
+        seam_ids.slots[seam_slot(seam_points[i])] = i;
+      slot = seam_slot(vertices[id]);
+    }
+    seam_ids.slots[slot] = seam_points.size();
+    seam_points.push_back(vertices[id]);
+    seam_vertices.push_back(id);
+  }
+  
+  // vertex of the seam at the 3D point, every cap point should be one
+  // a point that isn't gets a vertex of its own
+  int seam_id(stl_vertex vertex) {
+    int i = seam_ids.slots[seam_slot(vertex)];
+    if (i >= 0) return seam_vertices[i];
+    vertices.push_back(vertex);
+    moves.push_back(-1);
+    add_seam(vertices.size() - 1);
+    return vertices.size() - 1;
+  }
+  
+  void clear() {
+    upper.clear();
+    lower.clear();
+    border.clear();
+    counts = stl_case_counts();
+    edges.clear();
+    intersections.clear(0);
+  }
+  
+  // slot of the edge in the intersections, or the empty slot it would take
+  size_t find(unsigned long long key) const {
+    size_t slot = intersections.first(key ^ key >> 32);
+    while (intersections.slots[slot] >= 0 && edges[intersections.slots[slot]] != key)
+      slot = intersections.next(slot);
+    return slot;
+  }
+  
+  // the same point as stl_intersection_cache::intersection() gives for the vertices
+  int intersection(stl_plane plane, int a, int b) {
+    unsigned long long key = a < b ? (unsigned long long)a << 32 | b : (unsigned long long)b << 32 | a;
+    size_t slot = find(key);
+    if (intersections.slots[slot] >= 0) return first_intersection + intersections.slots[slot];
+    stl_vertex va = vertices[a], vb = vertices[b];
+    if (vertex_less(vb, va)) std::swap(va, vb);
+    vertices.push_back(plane.intersection(va, vb));
+    if (intersections.full(edges.size())) {
+      intersections.clear(2 * (edges.size() + 1));
+      for (size_t i = 0; i < edges.size(); i++)
+        intersections.slots[find(edges[i])] = i;
+      slot = find(key);
+    }
+    intersections.slots[slot] = edges.size();
+    edges.push_back(key);
+    return vertices.size() - 1;
+  }
+  
+  void add(std::vector<stl_triangle> &part, const stl_triangle &original, int a, int b, int c) {
+    stl_triangle t = original;
+    t.vertex[0] = a;
+    t.vertex[1] = b;
+    t.vertex[2] = c;
+    part.push_back(t);
+  }
+  
+  void add_border(int a, int b) {
+    border.push_back(a);
+    border.push_back(b);
+  }
+};
+
+// separate() for a triangle of an indexed mesh
+// every vertex is classified once beforehand and every crossing edge is intersected once
+void separate_triangle(const stl_triangle &triangle, stl_plane plane, const unsigned char* positions,
+                       stl_indexed_cut &out) {
+  const int* v = triangle.vertex;
+  stl_position pos[3];
+  size_t aboves = 0, belows = 0, ons = 0;
+  for (size_t i = 0; i < 3; i++) {
+    pos[i] = (stl_position)positions[v[i]];
+    if (pos[i] == above) aboves++;
+    else if (pos[i] == below) belows++;
+    else ons++;
+  }
+  
+  if (aboves == 3) {
+    out.counts[case_above]++;
+    out.upper.push_back(triangle);
+    return;
+  }
+  if (belows == 3) {
+    out.counts[case_below]++;
+    out.lower.push_back(triangle);
+    return;
+  }
+  if (ons == 3) {
+    out.counts[case_coplanar]++;
+    return;
+  }
+  
+  if (ons == 2) {
+    out.counts[case_edge_on]++;
+    for (size_t i = 0; i < 3; i++) {
+      if (pos[i] == above) {
+        out.upper.push_back(triangle);
+        out.add_border(v[(i+1)%3], v[(i+2)%3]);
+      } else if (pos[i] == below) {
+        out.lower.push_back(triangle);
+        out.add_border(v[(i+2)%3], v[(i+1)%3]);
+      }
+    }
+    return;
+  }
+  
+  if (ons == 1) {
+    if (aboves == 2 || belows == 2) {
+      out.counts[case_vertex_on]++;
+      out.add(aboves == 2 ? out.upper : out.lower, triangle, v[0], v[1], v[2]);
+      return;
+    }
+    // like simple_cut()
+    size_t i = pos[0] == on ? 0 : pos[1] == on ? 1 : 2;
+    int zero = v[i], one = v[(i+1)%3], two = v[(i+2)%3];
+    bool up = pos[(i+1)%3] == above;
+    out.counts[case_simple_cut]++;
+    int middle = out.intersection(plane, one, two);
+    out.add(up ? out.upper : out.lower, triangle, middle, zero, one);
+    out.add(up ? out.lower : out.upper, triangle, middle, two, zero);
+    out.add_border(zero, middle);
+    return;
+  }
+  
+  // like complex_cut(), from the vertex alone on its side
+  out.counts[case_complex_cut]++;
+  stl_position alone = aboves == 1 ? above : below;
+  size_t i = pos[0] == alone ? 0 : pos[1] == alone ? 1 : 2;
+  int zero = v[i], one = v[(i+1)%3], two = v[(i+2)%3];
+  bool up = alone == above;
+  int one_middle = out.intersection(plane, zero, one);
+  int two_middle = out.intersection(plane, zero, two);
+  out.add(up ? out.upper : out.lower, triangle, zero, one_middle, two_middle);
+  out.add(up ? out.lower : out.upper, triangle, one_middle, one, two);
+  out.add(up ? out.lower : out.upper, triangle, one_middle, two, two_middle);
+  out.add_border(one_middle, two_middle);
+}
+
+// separates an indexed mesh and stitches the seam, the parts are final but the cap
+// returns false if there's no cap to triangulate
+bool separate_indexed(const stl_indexed_mesh &mesh, stl_plane plane, stl_indexed_cut &out,
+                      stl_cap_buffers &cap, stl_report &report) {
+  report.start();
+  out.clear();
+  out.vertices.assign(mesh.vertices.begin(), mesh.vertices.end());
+  out.first_intersection = out.vertices.size();
+  
+  // classify every vertex once
+  size_t count = mesh.vertices.size();
+  size_t padded = count + (CLASSIFY_WIDTH - count % CLASSIFY_WIDTH) % CLASSIFY_WIDTH;
+  out.x.assign(padded, 0);
+  out.y.assign(padded, 0);
+  out.z.assign(padded, 0);
+  out.pos.resize(padded);
+  for (size_t i = 0; i < count; i++) {
+    out.x[i] = mesh.vertices[i].x;
+    out.y[i] = mesh.vertices[i].y;
+    out.z[i] = mesh.vertices[i].z;
+  }
+  if (padded) classify(&out.x[0], &out.y[0], &out.z[0], padded, plane, &out.pos[0]);
+  
+  for (std::vector<stl_triangle>::const_iterator t = mesh.triangles.begin(); t != mesh.triangles.end(); t++)
+    separate_triangle(*t, plane, out.pos.empty() ? NULL : &out.pos[0], out);
+  report.cases.add(out.counts);
+  report.stop("separate");
+  
+  // the cap is made from 3D edges and goes back to the seam vertices
+  out.seam.clear();
+  out.seam_points.clear();
+  out.seam_vertices.clear();
+  out.seam_ids.clear(out.border.size());
+  out.moves.assign(out.vertices.size(), -1);
+  out.moved = 0;
+  for (size_t i = 0; i < out.border.size(); i += 2) {
+    int a = out.border[i], b = out.border[i+1];
+    out.seam.push_back(stl_vertex_pair(out.vertices[a], out.vertices[b]));
+    out.add_seam(a);
+    out.add_seam(b);
+  }
+  out.cap_upper.clear();
+  out.cap_lower.clear();
+  if (!stitch_border(out.seam, plane, cap, report)) return false;
+  
+  // like weld_seam(), but the seam vertices falling to one cap point are replaced
+  // by the vertex of the cap, so the parts share it by index
+  // a replaced vertex can be replaced again, by a weld of the point it got
+  // triangles collapsed by this are left out, their edges cancel each other
+  for (std::vector<stl_vertex_pair>::const_iterator i = cap.welds.begin(); i != cap.welds.end(); i++, out.moved++)
+    out.moves[out.seam_id(i->x)] = out.seam_id(i->y);
+  if (!out.moved) return true;
+  for (size_t k = 0; k < 2; k++) {
+    std::vector<stl_triangle> &part = k ? out.lower : out.upper;
+    size_t kept = 0;
+    for (size_t i = 0; i < part.size(); i++) {
+      stl_triangle t = part[i];
+      bool moved = false;
+      for (size_t j = 0; j < 3; j++) {
+        while (out.moves[t.vertex[j]] >= 0) {
+          t.vertex[j] = out.moves[t.vertex[j]];
+          moved = true;
+        }
+      }
+      if (moved && (t.vertex[0] == t.vertex[1] || t.vertex[1] == t.vertex[2] || t.vertex[2] == t.vertex[0]))
+        continue;
+      part[kept++] = t;
+    }
+    part.erase(part.begin() + kept, part.end());
+  }
+  return true;
+}
+
+// adds the cap triangulated after separate_indexed() to the parts,
+// the cap triangles use the vertices of the seam
+void add_cap(stl_indexed_cut &out) {
+  for (size_t k = 0; k < 2; k++) {
+    const std::vector<stl_facet> &facets = k ? out.cap_lower : out.cap_upper;
+    std::vector<stl_triangle> &part = k ? out.lower : out.upper;
+    for (std::vector<stl_facet>::const_iterator f = facets.begin(); f != facets.end(); f++) {
+      stl_triangle t;
+      for (size_t j = 0; j < 3; j++)
+        t.vertex[j] = out.seam_id(f->vertex[j]);
+      t.normal = f->normal;
+      t.extra[0] = t.extra[1] = 0;
+      part.push_back(t);
+    }
+  }
+}
+
+// output file formats of the default mode
+// OBJ, PLY and 3MF are indexed, every vertex of a part is written once
+enum stl_format { format_stl, format_obj, format_ply, format_3mf };
+const char* format_names[] = {"stl", "obj", "ply", "3mf"};
+
+// one part of an indexed cut with its own compact vertex numbering
+struct stl_indexed_part {
+  std::vector<stl_vertex> vertices;
+  std::vector<int> indices; // three per triangle
+  std::vector<int> remap; // vertex of the cut to the vertex of the part, -1 if unused
+  
+  // takes the vertices used by the part in the order of their first use
+  void build(const stl_indexed_cut &cut, const std::vector<stl_triangle> &part) {
+    vertices.clear();
+    indices.resize(3 * part.size());
+    remap.assign(cut.vertices.size(), -1);
+    for (size_t i = 0; i < part.size(); i++) {
+      for (size_t j = 0; j < 3; j++) {
+        int &id = remap[part[i].vertex[j]];
+        if (id < 0) {
+          id = vertices.size();
+          vertices.push_back(cut.vertices[part[i].vertex[j]]);
+        }
+        indices[3*i + j] = id;
+      }
+    }
+  }
+  
+  size_t triangles() const {
+    return indices.size() / 3;
+  }
+};
+
+// %.9g gives back the same float when read
+void write_obj(FILE* fp, const stl_indexed_part &part) {
+  fprintf(fp, "# stlcut\n");
+  for (std::vector<stl_vertex>::const_iterator v = part.vertices.begin(); v != part.vertices.end(); v++)
+    fprintf(fp, "v %.9g %.9g %.9g\n", v->x, v->y, v->z);
+  for (size_t i = 0; i < part.indices.size(); i += 3)
+    fprintf(fp, "f %d %d %d\n", part.indices[i] + 1, part.indices[i+1] + 1, part.indices[i+2] + 1);
+}
+
+// binary PLY is written in the byte order of the machine
+void write_ply(FILE* fp, const stl_indexed_part &part, bool ascii) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  const char* binary = "binary_big_endian";
+#else
+  const char* binary = "binary_little_endian";
+#endif
+  fprintf(fp, "ply\nformat %s 1.0\ncomment stlcut\n", ascii ? "ascii" : binary);
+  fprintf(fp, "element vertex %zu\nproperty float x\nproperty float y\nproperty float z\n", part.vertices.size());
+  fprintf(fp, "element face %zu\nproperty list uchar int vertex_indices\nend_header\n", part.triangles());
+  if (ascii) {
+    for (std::vector<stl_vertex>::const_iterator v = part.vertices.begin(); v != part.vertices.end(); v++)
+      fprintf(fp, "%.9g %.9g %.9g\n", v->x, v->y, v->z);
+    for (size_t i = 0; i < part.indices.size(); i += 3)
+      fprintf(fp, "3 %d %d %d\n", part.indices[i], part.indices[i+1], part.indices[i+2]);
+    return;
+  }
+  for (std::vector<stl_vertex>::const_iterator v = part.vertices.begin(); v != part.vertices.end(); v++)
+    fwrite(&v->x, sizeof(float), 3, fp);
+  // 13 bytes per face, the count and three indices
+  char face[1 + 3*sizeof(int)];
+  face[0] = 3;
+  for (size_t i = 0; i < part.indices.size(); i += 3) {
+    memcpy(face + 1, &part.indices[i], 3*sizeof(int));
+    fwrite(face, sizeof(face), 1, fp);
+  }
+}
+
+// zip archive with stored (uncompressed) entries, enough for a 3MF package
+struct stl_zip {
+  struct entry {
+    std::string name;
+    unsigned crc;
+    unsigned size;
+    unsigned offset;
+  };
+  FILE* fp;
+  std::vector<entry> entries;
+  unsigned offset;
+  bool ok;
+  
+  stl_zip(FILE* fp) {
+    this->fp = fp;
+    offset = 0;
+    ok = true;
+  }
+  
+  struct crc_table {
+    unsigned values[256];
+  };
+  
+  static crc_table make_crc_table() {
+    crc_table table;
+    for (unsigned i = 0; i < 256; i++) {
+      unsigned c = i;
+      for (size_t k = 0; k < 8; k++)
+        c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+      table.values[i] = c;
+    }
+    return table;
+  }
+  
+  // the table is made once, the halves may be written on two threads at the same time
+  static unsigned crc32(const std::string &data) {
+    static const crc_table table = make_crc_table();
+    unsigned crc = 0xffffffffU;
+    for (std::string::const_iterator i = data.begin(); i != data.end(); i++)
+      crc = table.values[(crc ^ (unsigned char)*i) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffffU;
+  }
+  
+  // little endian fields
+  static void put(std::string &out, unsigned value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++)
+      out += (char)(value >> 8*i);
+  }
+  
+  void add(const char* name, const std::string &data) {
+    // no zip64, the entries and the archive have to stay below 4 GB
+    if ((unsigned long long)offset + data.size() + 1024 > 0xffffffffULL) {
+      ok = false;
+      return;
+    }
+    entry e;
+    e.name = name;
+    e.crc = crc32(data);
+    e.size = data.size();
+    e.offset = offset;
+    std::string header;
+    put(header, 0x04034b50, 4);
+    put(header, 20, 2); // version needed
+    put(header, 0, 2); // flags
+    put(header, 0, 2); // stored
+    put(header, 0, 4); // time and date
+    put(header, e.crc, 4);
+    put(header, e.size, 4);
+    put(header, e.size, 4);
+    put(header, e.name.size(), 2);
+    put(header, 0, 2);
+    header += e.name;
+    fwrite(header.data(), 1, header.size(), fp);
+    fwrite(data.data(), 1, data.size(), fp);
+    offset += header.size() + data.size();
+    entries.push_back(e);
+  }
+  
+  // writes the central directory
+  void close() {
+    std::string directory;
+    for (std::vector<entry>::const_iterator e = entries.begin(); e != entries.end(); e++) {
+      put(directory, 0x02014b50, 4);
+      put(directory, 20, 2); // version made by
+      put(directory, 20, 2); // version needed
+      put(directory, 0, 2);
+      put(directory, 0, 2);
+      put(directory, 0, 4);
+      put(directory, e->crc, 4);
+      put(directory, e->size, 4);
+      put(directory, e->size, 4);
+      put(directory, e->name.size(), 2);
+      put(directory, 0, 2); // extra
+      put(directory, 0, 2); // comment
+      put(directory, 0, 2); // disk
+      put(directory, 0, 2); // internal attributes
+      put(directory, 0, 4); // external attributes
+      put(directory, e->offset, 4);
+      directory += e->name;
+    }
+    std::string end;
+    put(end, 0x06054b50, 4);
+    put(end, 0, 2);
+    put(end, 0, 2);
+    put(end, entries.size(), 2);
+    put(end, entries.size(), 2);
+    put(end, directory.size(), 4);
+    put(end, offset, 4);
+    put(end, 0, 2);
+    fwrite(directory.data(), 1, directory.size(), fp);
+    fwrite(end.data(), 1, end.size(), fp);
+  }
+};
+
+// 3MF package with one mesh object, the model itself is stored uncompressed
+void write_3mf(FILE* fp, const stl_indexed_part &part, bool &ok) {
+  std::string model;
+  model.reserve(50 * part.vertices.size() + 45 * part.triangles() + 512);
+  model += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+           "<model unit=\"millimeter\" xml:lang=\"en-US\""
+           " xmlns=\"http://schemas.microsoft.com/3dmanufacturing/core/2015/02\">\n"
+           " <resources>\n  <object id=\"1\" type=\"model\">\n   <mesh>\n    <vertices>\n";
+  char line[128];
+  for (std::vector<stl_vertex>::const_iterator v = part.vertices.begin(); v != part.vertices.end(); v++) {
+    snprintf(line, sizeof(line), "     <vertex x=\"%.9g\" y=\"%.9g\" z=\"%.9g\"/>\n", v->x, v->y, v->z);
+    model += line;
+  }
+  model += "    </vertices>\n    <triangles>\n";
+  for (size_t i = 0; i < part.indices.size(); i += 3) {
+    snprintf(line, sizeof(line), "     <triangle v1=\"%d\" v2=\"%d\" v3=\"%d\"/>\n",
+             part.indices[i], part.indices[i+1], part.indices[i+2]);
+    model += line;
+  }
+  model += "    </triangles>\n   </mesh>\n  </object>\n </resources>\n"
+           " <build>\n  <item objectid=\"1\"/>\n </build>\n</model>\n";
+  
+  stl_zip zip(fp);
+  zip.add("[Content_Types].xml",
+          "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+          "<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\">"
+          "<Default Extension=\"rels\" ContentType=\"application/vnd.openxmlformats-package.relationships+xml\"/>"
+          "<Default Extension=\"model\" ContentType=\"application/vnd.ms-package.3dmanufacturing-3dmodel+xml\"/>"
+          "</Types>\n");
+  zip.add("_rels/.rels",
+          "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+          "<Relationships xmlns=\"http://schemas.openxmlformats.org/package/2006/relationships\">"
+          "<Relationship Target=\"/3D/3dmodel.model\" Id=\"rel0\""
+          " Type=\"http://schemas.microsoft.com/3dmanufacturing/2013/01/3dmodel\"/>"
+          "</Relationships>\n");
+  zip.add("3D/3dmodel.model", model);
+  zip.close();
+  if (!zip.ok) ok = false;
+}
+
+// exports one part of an indexed cut in an indexed format
+bool export_indexed(const stl_indexed_cut &cut, const std::vector<stl_triangle> &triangles, const char* name,
+                    stl_format format, bool ascii, stl_indexed_part &part, stl_report &report) {
+  report.start();
+  part.build(cut, triangles);
+  bool ok = true;
+  FILE* fp = fopen(name, format == format_obj || (format == format_ply && ascii) ? "w" : "wb");
+  if (fp) {
+    setvbuf(fp, NULL, _IOFBF, WRITER_BUFFER_SIZE);
+    if (format == format_obj) write_obj(fp, part);
+    else if (format == format_ply) write_ply(fp, part, ascii);
+    else write_3mf(fp, part, ok);
+    if (ferror(fp)) ok = false;
+    if (fclose(fp) != 0) ok = false;
+  } else {
+    ok = false;
+  }
+  report.output_facets += part.triangles();
+  report.stop("write");
+  if (!ok) std::cerr << "Cannot write " << name << std::endl;
+  return ok;
+}
+
+// output of one half of a cut, the halves go out on threads of their own
+// STL goes out from the facets of the part, the indexed formats from the indexed cut
+struct stl_half_output {
+  const std::vector<stl_facet>* facets;
+  const stl_indexed_cut* cut;
+  const std::vector<stl_triangle>* part;
+  std::string name;
+  stl_format format;
+  bool ascii;
+  bool repair;
+  int threads;
+  stl_indexed_part indexed;
+  stl_writer writer;
+  size_t written; // facets of the part written so far by write_available()
+  stl_report report;
+  bool ok;
+  
+  void setup(const std::vector<stl_facet> &facets, const char* half, bool ascii, bool repair, int threads) {
+    this->facets = &facets;
+    this->cut = NULL;
+    this->part = NULL;
+    start(half, format_stl, ascii, repair, threads);
+  }
+  
+  void setup(const stl_indexed_cut &cut, const std::vector<stl_triangle> &part, const char* half,
+             stl_format format, bool ascii, int threads) {
+    this->facets = NULL;
+    this->cut = &cut;
+    this->part = &part;
+    start(half, format, ascii, false, threads);
+  }
+  
+  void start(const char* half, stl_format format, bool ascii, bool repair, int threads) {
+    this->name = std::string(half) + "." + format_names[format];
+    this->format = format;
+    this->ascii = ascii;
+    this->repair = repair;
+    this->threads = threads;
+    written = 0;
+    report.clear();
+    ok = true;
+  }
+  
+  // exports the complete part
+  void run() {
+    if (format != format_stl)
+      ok = export_indexed(*cut, *part, name.c_str(), format, ascii, indexed, report);
+    else
+      ok = export_stl(*facets, name.c_str(), ascii, repair, threads, report);
+  }
+  
+  // STL without the repair goes out as it comes, these are the facets the part has now
+  void write_available() {
+    size_t end = facets->size();
+    if (written < end) writer.write(&(*facets)[written], end - written);
+    written = end;
+  }
+};
+
+// state of the cutting kept from one cut to the next,
+// so a program cutting many meshes doesn't allocate all the buffers again
+struct stl_cut_context {
+  int threads;
+  bool repair; // full stl_repair() of exported parts
+  stl_separated separated;
+  std::vector<stl_separated> parts;
+  stl_cap_buffers cap;
+  stl_indexed_mesh mesh;
+  stl_indexed_cut indexed;
+  stl_half_output halves[2];
+  std::vector<stl_facet> cap_upper, cap_lower; // triangulated while the parts are written
+  stl_report report;
+  
+  // threads <= 0 means one thread per core
+  stl_cut_context(int threads) {
+    if (threads <= 0) threads = std::thread::hardware_concurrency();
+    this->threads = STL_MAX(threads, 1);
+    repair = true;
+  }
+  
+  // empties everything from the previous cut
+  void clear() {
+    separated.clear();
+    report.clear();
+  }
+};
+
+// true if all vertices of the facet are above the plane
+bool wholly_above(const stl_facet &facet, stl_plane plane) {
+  for (size_t i = 0; i < 3; i++)
+    if (plane.position(facet.vertex[i]) != above) return false;
+  return true;
+}
+
+// true if all vertices of the facet are below the plane
+bool wholly_below(const stl_facet &facet, stl_plane plane) {
+  for (size_t i = 0; i < 3; i++)
+    if (plane.position(facet.vertex[i]) != below) return false;
+  return true;
+}
+
+// output of one slab cutting thread
+// one vector per slab, from the lowest, and one border and cache per plane
+struct stl_slabs {
+  std::vector<std::vector<stl_facet> > slabs;
+  std::vector<std::vector<stl_vertex_pair> > borders;
+  std::vector<stl_intersection_cache> caches;
+  stl_case_counts counts;
+  
+  stl_slabs(size_t planes) : slabs(planes+1), borders(planes), caches(planes) {}
+};
+
+// cuts facets from begin to end by parallel planes sorted from the lowest
+// the planes a facet spans are found by binary search and only those cut it,
+// the pieces above one plane go on to the next one
+template <class stl_facets>
+void slab_range(const stl_facets &facets, int begin, int end, const std::vector<stl_plane> &planes,
+                stl_slabs &out) {
+  std::vector<stl_facet> pieces, upper;
+  for (int i = begin; i < end; i++) {
+    stl_facet facet = facets.facet(i);
+    
+    // the first plane the facet isn't wholly above
+    size_t low = 0, high = planes.size();
+    while (low < high) {
+      size_t middle = (low + high) / 2;
+      if (wholly_above(facet, planes[middle])) low = middle + 1;
+      else high = middle;
+    }
+    size_t first = low;
+    
+    // the first plane the facet is wholly below
+    high = planes.size();
+    while (low < high) {
+      size_t middle = (low + high) / 2;
+      if (wholly_below(facet, planes[middle])) high = middle;
+      else low = middle + 1;
+    }
+    size_t last = low;
+    
+    if (first == last) {
+      out.counts[first == planes.size() ? case_above : case_below]++;
+      out.slabs[first].push_back(facet);
+      continue;
+    }
+    
+    pieces.clear();
+    pieces.push_back(facet);
+    for (size_t k = first; k < last; k++) {
+      upper.clear();
+      for (std::vector<stl_facet>::iterator piece = pieces.begin(); piece != pieces.end(); piece++)
+        separate(*piece, planes[k], upper, out.slabs[k], out.borders[k], out.caches[k], out.counts);
+      pieces.swap(upper);
+    }
+    out.slabs[last].insert(out.slabs[last].end(), pieces.begin(), pieces.end());
+  }
+}
+
+// cuts all facets to slabs in one pass, using up to given number of threads
+// like in separate_all(), the output is the same for any number of threads
+template <class stl_facets>
+void slab_all(const stl_facets &facets, int count, const std::vector<stl_plane> &planes, int threads,
+              stl_slabs &out) {
+  threads = STL_MIN(threads, count / THREAD_MIN_FACETS);
+  if (threads <= 1) {
+    slab_range(facets, 0, count, planes, out);
+    return;
+  }
+  
+  std::vector<stl_slabs> parts(threads, stl_slabs(planes.size()));
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    int begin = (long)count*t/threads;
+    int end = (long)count*(t+1)/threads;
+    workers.push_back(std::thread(slab_range<stl_facets>, std::cref(facets), begin, end,
+                                  std::cref(planes), std::ref(parts[t])));
+  }
+  for (int t = 0; t < threads; t++) {
+    workers[t].join();
+    stl_slabs &part = parts[t];
+    for (size_t k = 0; k < part.slabs.size(); k++)
+      out.slabs[k].insert(out.slabs[k].end(), part.slabs[k].begin(), part.slabs[k].end());
+    for (size_t k = 0; k < part.borders.size(); k++)
+      out.borders[k].insert(out.borders[k].end(), part.borders[k].begin(), part.borders[k].end());
+    out.counts.add(part.counts);
+    part = stl_slabs(0);
+  }
+}
+
+// cuts the file to slabs at given heights along the normal of the plane
+// writes slab_0.stl (below all planes) to slab_N.stl
+bool slab_cut(const char* name, stl_plane plane, std::vector<double> heights, bool ascii,
+              stl_cut_context &context) {
+  stl_report &report = context.report;
+  std::sort(heights.begin(), heights.end());
+  heights.erase(std::unique(heights.begin(), heights.end()), heights.end());
+  std::vector<stl_plane> planes;
+  for (size_t k = 0; k < heights.size(); k++)
+    planes.push_back(stl_plane(plane.x, plane.y, plane.z, -heights[k]));
+  
+  report.start();
+  stl_input input;
+  if (!input.open(name, context.threads)) {
+    std::cerr << "Cannot read " << name << std::endl;
+    return false;
+  }
+  report.input_facets = input.number_of_facets;
+  report.stop("load");
+  
+  report.start();
+  stl_slabs out(planes.size());
+  slab_all(input, input.number_of_facets, planes, context.threads, out);
+  input.close();
+  report.cases.add(out.counts);
+  report.stop("separate");
+  
+  // the cap of a plane closes the slab below and the slab above it
+  for (size_t k = 0; k < planes.size(); k++)
+    triangulate_border(out.borders[k], planes[k], out.slabs[k+1], out.slabs[k], context.cap, context.threads,
+                       report);
+  
+  for (size_t k = 0; k < out.slabs.size(); k++) {
+    char slab_name[32];
+    snprintf(slab_name, sizeof(slab_name), "slab_%d.stl", (int)k);
+    if (!export_stl(out.slabs[k], slab_name, ascii, context.repair, context.threads, report)) return false;
+  }
+  return true;
+}
+
+// parses comma separated numbers, returns false on error
+bool parse_list(const char* text, std::vector<double> &numbers) {
+  numbers.clear();
+  while (true) {
+    char* end;
+    numbers.push_back(strtod(text, &end));
+    if (end == text) return false;
+    if (*end == '\0') return true;
+    if (*end != ',') return false;
+    text = end + 1;
+  }
+}
+
+// separates a chunk of a binary file to binary files
+// runs of blocks wholly on one side of the plane are copied from file to file by the kernel
+void separate_chunk(stl_reader &reader, const stl_facet* chunk, int n, stl_plane plane,
+                    stl_writer &upper_out, stl_writer &lower_out, stl_cut_context &context) {
+  stl_report &report = context.report;
+  stl_separated &out = context.separated;
+  long start = reader.position - n;
+  
+  report.start();
+  int begin = 0;
+  int side = block_side(chunk, STL_MIN(CLASSIFY_BLOCK, n), plane);
+  for (int first = CLASSIFY_BLOCK; ; first += CLASSIFY_BLOCK) {
+    int next = first < n ? block_side(chunk + first, STL_MIN(CLASSIFY_BLOCK, n - first), plane) : 2;
+    if (next == side) continue;
+    
+    // the run from begin ends here
+    int end = STL_MIN(first, n);
+    if (side == 0) {
+      separate_all(stl_facet_array(chunk + begin), end - begin, plane, context.threads, out, context.parts);
+      report.stop("separate");
+      report.start();
+      upper_out.write(out.upper);
+      lower_out.write(out.lower);
+      out.clear_parts();
+    } else {
+      out.counts[side > 0 ? case_above : case_below] += end - begin;
+      report.stop("separate");
+      report.start();
+      (side > 0 ? upper_out : lower_out).copy(fileno(reader.fp), HEADER_SIZE + (start + begin)*SIZEOF_STL_FACET,
+                                              &reader.records[(size_t)begin*SIZEOF_STL_FACET], end - begin);
+    }
+    report.stop("write");
+    if (end == n) break;
+    report.start();
+    begin = first;
+    side = next;
+  }
+}
+
+// cuts the file chunk by chunk and writes the parts right away
+// only the border stays in memory, the output isn't repaired
+bool stream_cut(const char* name, stl_plane plane, const char* upper_name, const char* lower_name,
+                bool ascii, stl_cut_context &context) {
+  stl_report &report = context.report;
+  stl_reader reader;
+  if (!reader.open(name)) {
+    std::cerr << "Cannot read " << name << std::endl;
+    return false;
+  }
+  stl_writer upper_out, lower_out;
+  upper_out.threads = lower_out.threads = context.threads;
+  if (!upper_out.open(upper_name, ascii) || !lower_out.open(lower_name, ascii)) {
+    upper_out.discard();
+    std::cerr << "Cannot write output" << std::endl;
+    return false;
+  }
+  
+  stl_separated &out = context.separated;
+  std::vector<stl_facet> &upper = out.upper, &lower = out.lower;
+  std::vector<stl_facet> chunk(STREAM_CHUNK_FACETS);
+  while (true) {
+    report.start();
+    int n = reader.read(&chunk[0], chunk.size());
+    report.input_facets += n;
+    report.stop("load");
+    if (n <= 0) break;
+    
+    if (!reader.ascii && !ascii) {
+      separate_chunk(reader, &chunk[0], n, plane, upper_out, lower_out, context);
+      continue;
+    }
+    
+    report.start();
+    separate_all(stl_facet_array(&chunk[0]), n, plane, context.threads, out, context.parts);
+    report.stop("separate");
+    
+    report.start();
+    upper_out.write(upper);
+    lower_out.write(lower);
+    out.clear_parts();
+    report.stop("write");
+  }
+  reader.close();
+  report.cases.add(out.counts);
+  if (reader.error) {
+    upper_out.discard();
+    lower_out.discard();
+    std::cerr << "Cannot read " << name << ", facet " << reader.position + 1 << " is broken" << std::endl;
+    return false;
+  }
+  
+  triangulate_border(out.border, plane, upper, lower, context.cap, context.threads, report);
+  
+  report.start();
+  upper_out.write(upper);
+  lower_out.write(lower);
+  // both are closed whatever the other one gives
+  bool upper_ok = upper_out.close();
+  bool lower_ok = lower_out.close();
+  bool ok = upper_ok && lower_ok;
+  report.output_facets = upper_out.number_of_facets + lower_out.number_of_facets;
+  report.stop("write");
+  
+  if (!ok) {
+    std::cerr << "Cannot write output" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// cuts the file to upper and lower files of the format
+// STL is cut facet by facet, the indexed formats from an indexed mesh and without the full repair
+// on more threads, the halves are written at the same time
+bool cut(const char* name, stl_plane plane, bool ascii, stl_format format, stl_cut_context &context) {
+  stl_report &report = context.report;
+  report.start();
+  stl_input input;
+  if (!input.open(name, context.threads)) {
+    std::cerr << "Cannot read " << name << std::endl;
+    return false;
+  }
+  report.input_facets = input.number_of_facets;
+  report.stop("load");
+  stl_half_output &upper = context.halves[0], &lower = context.halves[1];
+  int threads = STL_MAX(1, context.threads / 2);
+  
+  if (format != format_stl) {
+    // weld the vertices, so every vertex of the parts is written once
+    report.start();
+    index_facets(input, input.number_of_facets, context.mesh, context.indexed.table);
+    input.close();
+    report.stop("index");
+    
+    stl_indexed_cut &out = context.indexed;
+    if (separate_indexed(context.mesh, plane, out, context.cap, report)) {
+      triangulate_loops(plane, out.cap_upper, out.cap_lower, context.cap, context.threads, report);
+      add_cap(out);
+    }
+    upper.setup(out, out.upper, "upper", format, ascii, threads);
+    lower.setup(out, out.lower, "lower", format, ascii, threads);
+  } else {
+    // separate all facets
+    report.start();
+    stl_separated &out = context.separated;
+    separate_all(input, input.number_of_facets, plane, context.threads, out, context.parts);
+    input.close();
+    report.cases.add(out.counts);
+    report.stop("separate");
+    
+    bool cap = stitch_border(out.border, plane, context.cap, report);
+    weld_seam(out, context.cap);
+    
+    if (context.threads > 1 && !context.repair) {
+      // the parts are final but the cap, they go out while the cap is triangulated
+      // and the cap follows them
+      upper.setup(out.upper, "upper", ascii, false, threads);
+      lower.setup(out.lower, "lower", ascii, false, threads);
+      upper.writer.threads = lower.writer.threads = threads;
+      if (!upper.writer.open(upper.name.c_str(), ascii) || !lower.writer.open(lower.name.c_str(), ascii)) {
+        upper.writer.discard();
+        std::cerr << "Cannot write output" << std::endl;
+        return false;
+      }
+      std::thread upper_thread(&stl_half_output::write_available, &upper);
+      std::thread lower_thread(&stl_half_output::write_available, &lower);
+      context.cap_upper.clear();
+      context.cap_lower.clear();
+      if (cap) triangulate_loops(plane, context.cap_upper, context.cap_lower, context.cap, context.threads, report);
+      
+      // the rest of writing, not hidden by the triangulation
+      report.start();
+      upper_thread.join();
+      lower_thread.join();
+      out.upper.insert(out.upper.end(), context.cap_upper.begin(), context.cap_upper.end());
+      out.lower.insert(out.lower.end(), context.cap_lower.begin(), context.cap_lower.end());
+      upper.write_available();
+      lower.write_available();
+      bool upper_ok = upper.writer.close();
+      bool lower_ok = lower.writer.close();
+      bool ok = upper_ok && lower_ok;
+      report.output_facets += out.upper.size() + out.lower.size();
+      report.stop("write");
+      if (!ok) std::cerr << "Cannot write output" << std::endl;
+      return ok;
+    }
+    
+    if (cap) triangulate_loops(plane, out.upper, out.lower, context.cap, context.threads, report);
+    upper.setup(out.upper, "upper", ascii, context.repair, threads);
+    lower.setup(out.lower, "lower", ascii, context.repair, threads);
+  }
+  
+  // the repair and the writing of one half don't depend on the other half
+  if (context.threads > 1) {
+    std::thread upper_thread(&stl_half_output::run, &upper);
+    lower.run();
+    upper_thread.join();
+  } else {
+    upper.run();
+    if (upper.ok) lower.run();
+  }
+  report.add(upper.report, context.threads > 1);
+  report.add(lower.report, context.threads > 1);
+  return upper.ok && lower.ok;
+}
+
+// cuts facets held in memory, the parts stay in the context
+void cut_facets(stl_cut_context &context, const stl_facet* facets, int count, stl_plane plane) {
+  context.clear();
+  stl_separated &out = context.separated;
+  context.report.input_facets = count;
+  
+  context.report.start();
+  separate_all(stl_facet_array(facets), count, plane, context.threads, out, context.parts);
+  context.report.cases.add(out.counts);
+  context.report.stop("separate");
+  
+  triangulate_border(out.border, plane, out.upper, out.lower, context.cap, context.threads, context.report);
+  weld_seam(out, context.cap);
+  context.report.output_facets = out.upper.size() + out.lower.size();
+}
+
+// projection of the vertex to the normal of the plane,
+// plane.position() is the sign of projection + d, rounded the same way
+double projection(stl_plane plane, stl_vertex vertex) {
+  return (double)plane.x*vertex.x + (double)plane.y*vertex.y + (double)plane.z*vertex.z;
+}
+
+struct stl_projection_less {
+  const std::vector<double> &values;
+  stl_projection_less(const std::vector<double> &values) : values(values) {}
+  bool operator()(int a, int b) const {
+    return values[a] < values[b] || (values[a] == values[b] && a < b);
+  }
+};
+
+// cuts one mesh again and again by planes with the same normal
+// facets are indexed by the lowest and the highest projection of their vertices,
+// when only d changes, just the facets the plane was cutting
+// and the facets with a lowest or highest vertex in the swept slab are looked at
+struct stl_incremental {
+  const stl_facet* facets;
+  int count;
+  bool indexed;
+  stl_plane plane;
+  std::vector<double> low, high;
+  std::vector<int> by_low, by_high;  // facet ids sorted by low and high
+  std::vector<signed char> side;     // 1 wholly above, -1 wholly below, 0 cut
+  std::vector<int> slot;             // index of the facet in the list of its side
+  std::vector<int> above, below, cut; // facet ids
+  std::vector<int> seen;             // generation a facet was last looked at
+  int generation;
+  std::vector<int> candidates;
+  
+  stl_incremental() : plane(0,0,1,0) {
+    facets = NULL;
+    count = 0;
+    indexed = false;
+    generation = 0;
+  }
+  
+  // forget the index, the next cut builds it again
+  void reset() {
+    indexed = false;
+  }
+  
+  // side of the facet for given d, like the sign of plane.position() of all vertices
+  static signed char side_of(double low, double high, float d) {
+    if (low + d > 0) return 1;
+    if (high + d < 0) return -1;
+    return 0;
+  }
+  
+  // moves the facet to the list of given side
+  void move(int facet, signed char to) {
+    std::vector<int> &from_list = side[facet] > 0 ? above : side[facet] < 0 ? below : cut;
+    int last = from_list.back();
+    from_list[slot[facet]] = last;
+    slot[last] = slot[facet];
+    from_list.pop_back();
+    
+    std::vector<int> &to_list = to > 0 ? above : to < 0 ? below : cut;
+    slot[facet] = to_list.size();
+    to_list.push_back(facet);
+    side[facet] = to;
+  }
+  
+  void index(const stl_facet* facets, int count, stl_plane plane) {
+    this->facets = facets;
+    this->count = count;
+    this->plane = plane;
+    low.resize(count);
+    high.resize(count);
+    side.resize(count);
+    slot.resize(count);
+    seen.assign(count, 0);
+    generation = 0;
+    above.clear();
+    below.clear();
+    cut.clear();
+    by_low.resize(count);
+    by_high.resize(count);
+    for (int i = 0; i < count; i++) {
+      double p[3];
+      for (size_t j = 0; j < 3; j++)
+        p[j] = projection(plane, facets[i].vertex[j]);
+      low[i] = std::min(p[0], std::min(p[1], p[2]));
+      high[i] = std::max(p[0], std::max(p[1], p[2]));
+      side[i] = side_of(low[i], high[i], plane.d);
+      std::vector<int> &list = side[i] > 0 ? above : side[i] < 0 ? below : cut;
+      slot[i] = list.size();
+      list.push_back(i);
+      by_low[i] = by_high[i] = i;
+    }
+    std::sort(by_low.begin(), by_low.end(), stl_projection_less(low));
+    std::sort(by_high.begin(), by_high.end(), stl_projection_less(high));
+    indexed = true;
+  }
+  
+  // adds facets whose value + d > 0 differs for the old and the new d
+  void swept(const std::vector<int> &order, const std::vector<double> &values, float from, float to) {
+    // value + d > 0 holds for a suffix of the order, find where it starts for both d
+    size_t start[2];
+    float d[2] = { from, to };
+    for (size_t k = 0; k < 2; k++) {
+      size_t first = 0, last = order.size();
+      while (first < last) {
+        size_t middle = (first + last) / 2;
+        if (values[order[middle]] + d[k] > 0) last = middle;
+        else first = middle + 1;
+      }
+      start[k] = first;
+    }
+    // the same for value + d < 0 and a prefix
+    size_t end[2];
+    for (size_t k = 0; k < 2; k++) {
+      size_t first = 0, last = order.size();
+      while (first < last) {
+        size_t middle = (first + last) / 2;
+        if (values[order[middle]] + d[k] < 0) first = middle + 1;
+        else last = middle;
+      }
+      end[k] = first;
+    }
+    size_t begin = std::min(std::min(start[0], start[1]), std::min(end[0], end[1]));
+    size_t stop = std::max(std::max(start[0], start[1]), std::max(end[0], end[1]));
+    for (size_t i = begin; i < stop; i++) {
+      int facet = order[i];
+      if (seen[facet] == generation) continue;
+      seen[facet] = generation;
+      candidates.push_back(facet);
+    }
+  }
+  
+  // cuts the facets, the wholly above and below facets are left in the lists,
+  // the pieces of the cut facets and the cap go to the separated parts of the context
+  void run(stl_cut_context &context, const stl_facet* facets, int count, stl_plane plane) {
+    context.clear();
+    stl_report &report = context.report;
+    report.input_facets = count;
+    report.start();
+    
+    if (!indexed || this->facets != facets || this->count != count ||
+        plane.x != this->plane.x || plane.y != this->plane.y || plane.z != this->plane.z) {
+      index(facets, count, plane);
+    } else if (plane.d != this->plane.d) {
+      // the facets cut before and the facets in the swept slab may change side
+      generation++;
+      candidates.clear();
+      for (std::vector<int>::iterator i = cut.begin(); i != cut.end(); i++) {
+        seen[*i] = generation;
+        candidates.push_back(*i);
+      }
+      swept(by_low, low, this->plane.d, plane.d);
+      swept(by_high, high, this->plane.d, plane.d);
+      for (std::vector<int>::iterator i = candidates.begin(); i != candidates.end(); i++) {
+        signed char to = side_of(low[*i], high[*i], plane.d);
+        if (to != side[*i]) move(*i, to);
+      }
+      this->plane = plane;
+    }
+    
+    // ascending order keeps the pieces the same whatever the previous planes were
+    std::sort(cut.begin(), cut.end());
+    for (size_t i = 0; i < cut.size(); i++) slot[cut[i]] = i;
+    stl_separated &out = context.separated;
+    for (std::vector<int>::iterator i = cut.begin(); i != cut.end(); i++)
+      out.cut(facets[*i], plane);
+    out.counts[case_above] += above.size();
+    out.counts[case_below] += below.size();
+    report.cases.add(out.counts);
+    report.stop("separate");
+    
+    triangulate_border(out.border, plane, out.upper, out.lower, context.cap, context.threads, report);
+    weld_seam(out, context.cap);
+    report.output_facets = above.size() + below.size() + out.upper.size() + out.lower.size();
+  }
+  
+  // writes one part, the whole facets of the side and then the pieces
+  void write(stl_writer &writer, bool upper, const stl_separated &out) const {
+    const std::vector<int> &ids = upper ? above : below;
+    for (std::vector<int>::const_iterator i = ids.begin(); i != ids.end(); i++)
+      writer.write(facets[*i]);
+    writer.write(upper ? out.upper : out.lower);
+  }
+  
+  int number_of_facets(bool upper, const stl_separated &out) const {
+    return upper ? above.size() + out.upper.size() : below.size() + out.lower.size();
+  }
+};
+
+// loads the whole file to memory, returns false on error
+bool load_facets(const char* name, std::vector<stl_facet> &facets, int threads) {
+  stl_input input;
+  if (!input.open(name, threads)) return false;
+  facets.resize(input.number_of_facets);
+  for (int i = 0; i < input.number_of_facets; i++)
+    facets[i] = input.facet(i);
+  input.close();
+  return true;
+}
+
+// writes the parts of the last cut to files, returns false on error
+bool write_parts(const stl_incremental &cutter, const stl_separated &out,
+                 const char* upper_name, const char* lower_name) {
+  stl_writer upper_out, lower_out;
+  if (!upper_out.open(upper_name, false)) return false;
+  cutter.write(upper_out, true, out);
+  if (!upper_out.close()) return false;
+  if (!lower_out.open(lower_name, false)) return false;
+  cutter.write(lower_out, false, out);
+  return lower_out.close();
+}
+
+// keeps the mesh in memory and cuts it on request, one request per line on stdin:
+//   load FILE                    replaces the mesh
+//   cut A B C D UPPER LOWER      writes the parts to binary stl files
+//   cut A B C D                  sends the parts right after the reply
+//   quit
+// the reply is one line, "ok ..." or "error MESSAGE",
+// "ok" of a cut is followed by the number of upper and lower facets,
+// parts sent on stdout are plain 50 byte binary stl records, upper first
+// the parts aren't repaired, the order of the facets depends on the previous cuts
+// consecutive cuts with the same normal only look at the facets near both planes
+bool serve(const char* name, stl_cut_context &context) {
+  std::vector<stl_facet> mesh;
+  stl_incremental cutter;
+  if (!load_facets(name, mesh, context.threads)) {
+    std::cerr << "Cannot read " << name << std::endl;
+    return false;
+  }
+  
+  // raw records go through a writer with no header
+  stl_writer records;
+  records.fp = stdout;
+  setvbuf(stdout, NULL, _IOFBF, WRITER_BUFFER_SIZE);
+  
+  std::vector<char> line(4096);
+  std::vector<char> upper_name(line.size()), lower_name(line.size());
+  while (fgets(&line[0], line.size(), stdin)) {
+    float a, b, c, d;
+    int end = 0;
+    if (!strncmp(&line[0], "quit", 4)) {
+      break;
+    } else if (sscanf(&line[0], "load %4095s", &upper_name[0]) == 1) {
+      cutter.reset();
+      if (load_facets(&upper_name[0], mesh, context.threads))
+        printf("ok %d\n", (int)mesh.size());
+      else
+        printf("error cannot read %s\n", &upper_name[0]);
+    } else if (sscanf(&line[0], "cut %f %f %f %f %n", &a, &b, &c, &d, &end) == 4 && end > 0) {
+      if (a == 0 && b == 0 && c == 0) {
+        printf("error zero normal\n");
+        fflush(stdout);
+        continue;
+      }
+      cutter.run(context, mesh.empty() ? NULL : &mesh[0], mesh.size(), stl_plane(a, b, c, d));
+      const stl_separated &out = context.separated;
+      int upper_facets = cutter.number_of_facets(true, out);
+      int lower_facets = cutter.number_of_facets(false, out);
+      if (line[end] == '\0') {
+        printf("ok %d %d\n", upper_facets, lower_facets);
+        cutter.write(records, true, out);
+        cutter.write(records, false, out);
+      } else if (sscanf(&line[end], "%4095s %4095s", &upper_name[0], &lower_name[0]) == 2) {
+        if (write_parts(cutter, out, &upper_name[0], &lower_name[0]))
+          printf("ok %d %d\n", upper_facets, lower_facets);
+        else
+          printf("error cannot write output\n");
+      } else {
+        printf("error expected two file names\n");
+      }
+    } else {
+      printf("error unknown request\n");
+    }
+    fflush(stdout);
+  }
+  records.fp = NULL; // stdout isn't the writer's to close
+  return true;
+}
+
+// facets sorted by the lowest projection of their vertices to the normal
+// reach is the highest projection among the facets up to the index,
+// so a cut finds the facets wholly below and wholly above by binary search
+// facets much longer along the normal than usual would raise the reach of everything
+// after them, they are kept aside and always separated
+struct stl_cut_index {
+  stl_plane plane;
+  std::vector<stl_facet> facets;
+  std::vector<double> low;
+  std::vector<double> reach;
+  std::vector<stl_facet> long_facets;
+  
+  stl_cut_index(const stl_facet* facets, int count, stl_plane plane) : plane(plane) {
+    std::vector<double> low(count), high(count);
+    for (int i = 0; i < count; i++) {
+      double p[3];
+      for (size_t j = 0; j < 3; j++)
+        p[j] = projection(plane, facets[i].vertex[j]);
+      low[i] = std::min(p[0], std::min(p[1], p[2]));
+      high[i] = std::max(p[0], std::max(p[1], p[2]));
+    }
+    
+    // long is more than 4 times the median extent,
+    // facets parallel to the plane are left out of the median, else they could make it 0
+    std::vector<double> extents;
+    extents.reserve(count);
+    for (int i = 0; i < count; i++)
+      if (high[i] > low[i]) extents.push_back(high[i] - low[i]);
+    double limit = 0;
+    if (!extents.empty()) {
+      size_t half = extents.size() / 2;
+      std::nth_element(extents.begin(), extents.begin() + half, extents.end());
+      limit = 4 * extents[half];
+    }
+    
+    std::vector<int> order;
+    order.reserve(count);
+    for (int i = 0; i < count; i++) {
+      if (high[i] - low[i] > limit) long_facets.push_back(facets[i]);
+      else order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), stl_projection_less(low));
+    
+    this->facets.resize(order.size());
+    this->low.resize(order.size());
+    this->reach.resize(order.size());
+    double highest = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+      this->facets[i] = facets[order[i]];
+      this->low[i] = low[order[i]];
+      highest = i == 0 ? high[order[i]] : std::max(highest, high[order[i]]);
+      this->reach[i] = highest;
+    }
+  }
+  
+  // cuts by the plane with given d, the parts go to the separated parts of the context
+  void cut(stl_cut_context &context, float d) const {
+    context.clear();
+    stl_report &report = context.report;
+    report.input_facets = facets.size() + long_facets.size();
+    report.start();
+    stl_plane plane = this->plane;
+    plane.d = d;
+    
+    // [0, below) is wholly below, [above, size) wholly above, the same test as side_of()
+    size_t first = 0, last = facets.size();
+    while (first < last) {
+      size_t middle = (first + last) / 2;
+      if (reach[middle] + d < 0) first = middle + 1;
+      else last = middle;
+    }
+    size_t below = first;
+    last = facets.size();
+    while (first < last) {
+      size_t middle = (first + last) / 2;
+      if (low[middle] + d > 0) last = middle;
+      else first = middle + 1;
+    }
+    size_t above = first;
+    
+    stl_separated &out = context.separated;
+    out.lower.insert(out.lower.end(), facets.begin(), facets.begin() + below);
+    out.upper.insert(out.upper.end(), facets.begin() + above, facets.end());
+    out.counts[case_below] += below;
+    out.counts[case_above] += facets.size() - above;
+    for (size_t i = below; i < above; i++)
+      out.cut(facets[i], plane);
+    for (std::vector<stl_facet>::const_iterator i = long_facets.begin(); i != long_facets.end(); i++)
+      out.cut(*i, plane);
+    report.cases.add(out.counts);
+    report.stop("separate");
+    
+    triangulate_border(out.border, plane, out.upper, out.lower, context.cap, context.threads, report);
+    weld_seam(out, context.cap);
+    report.output_facets = out.upper.size() + out.lower.size();
+  }
+};
+
+stl_cut_context* stl_cut_context_new(int threads) {
+  return new stl_cut_context(threads);
+}
+
+void stl_cut_context_free(stl_cut_context* context) {
+  delete context;
+}
+
+void stl_cut(stl_cut_context* context, const stl_file* in, float a, float b, float c, float d,
+             stl_file* upper, stl_file* lower) {
+  cut_facets(*context, in->facet_start, in->stats.number_of_facets, stl_plane(a, b, c, d));
+  fill_stl(upper, context->separated.upper);
+  fill_stl(lower, context->separated.lower);
+}
+
+stl_cut_index* stl_cut_index_new(const stl_file* in, float a, float b, float c) {
+  return new stl_cut_index(in->facet_start, in->stats.number_of_facets, stl_plane(a, b, c, 0));
+}
+
+void stl_cut_index_free(stl_cut_index* index) {
+  delete index;
+}
+
+void stl_cut_indexed(stl_cut_context* context, const stl_cut_index* index, float d,
+                     stl_file* upper, stl_file* lower) {
+  index->cut(*context, d);
+  fill_stl(upper, context->separated.upper);
+  fill_stl(lower, context->separated.lower);
+}
+
+#ifndef STLCUT_LIBRARY
+
+int main(int argc, char **argv) {
+  const char* name = NULL;
+  bool stream = false;
+  bool ascii = false;
+  bool stats = false;
+  bool server = false;
+  bool repair = true;
+  std::vector<double> slabs;
+  int threads = 0;
+  stl_format format = format_stl;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--stream")) {
+      stream = true;
+    } else if (!strcmp(argv[i], "--ascii")) {
+      ascii = true;
+    } else if (!strcmp(argv[i], "--stats")) {
+      stats = true;
+    } else if (!strcmp(argv[i], "--no-repair")) {
+      repair = false;
+    } else if (!strcmp(argv[i], "--serve")) {
+      server = true;
+    } else if (!strcmp(argv[i], "--slabs") && i+1 < argc) {
+      if (!parse_list(argv[++i], slabs)) {
+        name = NULL;
+        break;
+      }
+    } else if (!strcmp(argv[i], "--threads") && i+1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--format") && i+1 < argc) {
+      i++;
+      size_t f = 0;
+      while (f < 4 && strcmp(argv[i], format_names[f])) f++;
+      if (f == 4) {
+        name = NULL;
+        break;
+      }
+      format = (stl_format)f;
+    } else if (!name && argv[i][0] != '-') {
+      name = argv[i];
+    } else {
+      name = NULL;
+      break;
+    }
+  }
+  // the other modes write STL only
+  if (!name || stream + server + !slabs.empty() > 1 || (format != format_stl && stream + server + !slabs.empty())) {
+    std::cerr << "Usage: " << argv[0] << " [--stream | --slabs h1,h2,... | --serve] [--ascii] [--no-repair] [--threads N]"
+              << " [--stats] [--format stl|obj|ply|3mf] file.stl" << std::endl;
+    return 1;
+  }
+  
+  stl_plane plane = stl_plane(0,0,1,0);
+  stl_cut_context context(threads);
+  context.repair = repair;
+  bool ok;
+  
+  if (server)
+    return serve(name, context) ? 0 : 1;
+  
+  if (!slabs.empty())
+    ok = slab_cut(name, plane, slabs, ascii, context);
+  else if (stream)
+    ok = stream_cut(name, plane, "upper.stl", "lower.stl", ascii, context);
+  else
+    ok = cut(name, plane, ascii, format, context);
+  
+  if (ok && stats) context.report.print(stdout);
+  return ok ? 0 : 1;
+}
+#endif
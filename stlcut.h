@@ -0,0 +1,62 @@
+/* Copyright 2015 Miro Hrončok <miro@hroncok.cz>
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+#ifndef STLCUT_H
+#define STLCUT_H
+
+// library interface of stlcut
+// build stlcut.cpp with -DSTLCUT_LIBRARY to leave main() out and link the object
+
+#include <admesh/stl.h>
+
+// reusable state of cutting
+// scratch buffers (facets, border, hash tables, cap points) keep their memory between cuts,
+// so repeated cuts of similar meshes don't allocate, but for poly2tri triangulating the cap
+// and starting the threads
+struct stl_cut_context;
+
+// creates a context, threads <= 0 means one thread per core
+stl_cut_context* stl_cut_context_new(int threads);
+
+void stl_cut_context_free(stl_cut_context* context);
+
+// cuts the mesh by the plane a*x + b*y + c*z + d = 0
+// upper gets the part where the left side is positive, lower the rest, both closed by the cap
+// upper and lower have to be zeroed (or stl_initialize()d) before the first cut and closed by
+// stl_close() after the last one, their memory is reused between cuts
+// the parts aren't repaired, stl_repair() them if needed
+void stl_cut(stl_cut_context* context, const stl_file* in, float a, float b, float c, float d,
+             stl_file* upper, stl_file* lower);
+
+// facets of a mesh sorted along one normal, for many cuts by parallel planes
+// a cut with the index only looks at the facets near the plane,
+// the rest is copied to the parts in bulk
+struct stl_cut_index;
+
+// builds the index of the mesh for planes with the normal (a, b, c)
+// the index keeps its own copy of the facets, in may be closed afterwards
+stl_cut_index* stl_cut_index_new(const stl_file* in, float a, float b, float c);
+
+void stl_cut_index_free(stl_cut_index* index);
+
+// like stl_cut() with the plane a*x + b*y + c*z + d = 0 of the index
+// the facets come out in a different order than from stl_cut(),
+// and as the border is walked in that order too, the cap may be triangulated differently
+void stl_cut_indexed(stl_cut_context* context, const stl_cut_index* index, float d,
+                     stl_file* upper, stl_file* lower);
+
+#endif
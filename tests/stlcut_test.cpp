@@ -0,0 +1,474 @@
+/* Copyright 2015 Miro Hrončok <miro@hroncok.cz>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+// stlcut tests
+// built together with stlcut.cpp as a library, so the internals can be tested too
+//
+// build: g++ -O2 -std=c++11 -pthread -o stlcut_test tests/stlcut_test.cpp -ladmesh -lpoly2tri
+// usage: stlcut_test, prints the failed checks and returns 1 if there are any
+
+#define STLCUT_LIBRARY
+#include "../stlcut.cpp"
+#include <unordered_map>
+
+static int failures = 0;
+
+// operator new calls, to see the buffers being reused
+// kept out of line, inlined malloc() and free() look mismatched to the compiler
+static long allocations = 0;
+
+__attribute__((noinline)) void* operator new(size_t size) {
+  allocations++;
+  void* memory = malloc(size ? size : 1);
+  if (!memory) throw std::bad_alloc();
+  return memory;
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+  free(memory);
+}
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+void check(bool ok, const char* condition, int line) {
+  if (ok) return;
+  fprintf(stderr, "stlcut_test.cpp:%d: check failed: %s\n", line, condition);
+  failures++;
+}
+
+stl_facet make_facet(stl_vertex a, stl_vertex b, stl_vertex c) {
+  stl_facet facet;
+  memset(&facet, 0, sizeof(facet));
+  facet.vertex[0] = a;
+  facet.vertex[1] = b;
+  facet.vertex[2] = c;
+  return facet;
+}
+
+stl_vertex make_vertex(double x, double y, double z) {
+  stl_vertex vertex;
+  vertex.x = x;
+  vertex.y = y;
+  vertex.z = z;
+  return vertex;
+}
+
+// closed tube around the z axis, the inner wall facets come first if holes_first
+std::vector<stl_facet> tube(bool holes_first) {
+  const int n = 32;
+  const double outer = 5, inner = 3, height = 4;
+  std::vector<stl_facet> walls, holes;
+  for (int i = 0; i < n; i++) {
+    double a = 2*M_PI*i/n, b = 2*M_PI*((i+1)%n)/n;
+    stl_vertex o0 = make_vertex(outer*cos(a), outer*sin(a), -height), o1 = make_vertex(outer*cos(b), outer*sin(b), -height);
+    stl_vertex O0 = make_vertex(outer*cos(a), outer*sin(a), height), O1 = make_vertex(outer*cos(b), outer*sin(b), height);
+    stl_vertex i0 = make_vertex(inner*cos(a), inner*sin(a), -height), i1 = make_vertex(inner*cos(b), inner*sin(b), -height);
+    stl_vertex I0 = make_vertex(inner*cos(a), inner*sin(a), height), I1 = make_vertex(inner*cos(b), inner*sin(b), height);
+    walls.push_back(make_facet(o0, o1, O1));
+    walls.push_back(make_facet(o0, O1, O0));
+    holes.push_back(make_facet(i0, I1, i1));
+    holes.push_back(make_facet(i0, I0, I1));
+    walls.push_back(make_facet(I0, O0, O1));
+    walls.push_back(make_facet(I0, O1, I1));
+    walls.push_back(make_facet(i0, o1, o0));
+    walls.push_back(make_facet(i0, i1, o1));
+  }
+  std::vector<stl_facet> facets = holes_first ? holes : walls;
+  const std::vector<stl_facet> &rest = holes_first ? walls : holes;
+  facets.insert(facets.end(), rest.begin(), rest.end());
+  return facets;
+}
+
+// torus around the x axis like the one of the benchmark, the z = 0 plane cuts it lengthwise
+// intersections of different edges meet there and some fall to one point on the plane with others
+std::vector<stl_facet> torus(int minor) {
+  int major = 4*minor;
+  const double R = 10, r = 3;
+  std::vector<stl_vertex> grid(major * minor);
+  for (int i = 0; i < major; i++) {
+    double u = 2*M_PI*i/major;
+    for (int j = 0; j < minor; j++) {
+      double v = 2*M_PI*(j + 0.5)/minor;
+      double w = R + r*cos(v);
+      grid[i*minor + j] = make_vertex(r*sin(v), w*cos(u), w*sin(u));
+    }
+  }
+  std::vector<stl_facet> facets;
+  for (int i = 0; i < major; i++) {
+    for (int j = 0; j < minor; j++) {
+      int i1 = (i+1)%major, j1 = (j+1)%minor;
+      stl_vertex a = grid[i*minor + j], b = grid[i1*minor + j], c = grid[i1*minor + j1], d = grid[i*minor + j1];
+      facets.push_back(make_facet(a, b, c));
+      facets.push_back(make_facet(a, c, d));
+    }
+  }
+  return facets;
+}
+
+// number of directed edges without the opposite edge, 0 for a closed mesh
+size_t open_edges(const std::vector<stl_facet> &facets) {
+  std::unordered_map<stl_vertex_pair, int, stl_vertex_pair_hash> edges;
+  for (size_t i = 0; i < facets.size(); i++)
+    for (size_t j = 0; j < 3; j++)
+      edges[stl_vertex_pair(facets[i].vertex[j], facets[i].vertex[(j+1)%3])]++;
+  size_t open = 0;
+  for (std::unordered_map<stl_vertex_pair, int, stl_vertex_pair_hash>::iterator e = edges.begin(); e != edges.end(); e++) {
+    std::unordered_map<stl_vertex_pair, int, stl_vertex_pair_hash>::iterator back =
+      edges.find(stl_vertex_pair(e->first.y, e->first.x));
+    if (back == edges.end() || back->second != e->second) open += e->second;
+  }
+  return open;
+}
+
+// the same for the vertex indices of triangles
+size_t open_edges(const std::vector<stl_triangle> &triangles) {
+  std::unordered_map<unsigned long long, int> edges;
+  for (size_t i = 0; i < triangles.size(); i++)
+    for (size_t j = 0; j < 3; j++)
+      edges[(unsigned long long)triangles[i].vertex[j] << 32 | (unsigned)triangles[i].vertex[(j+1)%3]]++;
+  size_t open = 0;
+  for (std::unordered_map<unsigned long long, int>::iterator e = edges.begin(); e != edges.end(); e++) {
+    std::unordered_map<unsigned long long, int>::iterator back = edges.find(e->first << 32 | e->first >> 32);
+    if (back == edges.end() || back->second != e->second) open += e->second;
+  }
+  return open;
+}
+
+// the parts of an indexed cut and the cap share the seam vertices by index,
+// also where the seam had more vertices at a point or was welded
+void test_indexed_cut_is_closed() {
+  std::vector<stl_facet> facets = torus(35);
+  stl_cut_context context(1);
+  stl_plane plane(0, 0, 1, 0);
+  index_facets(stl_facet_array(&facets[0]), facets.size(), context.mesh, context.indexed.table);
+  stl_indexed_cut &out = context.indexed;
+  CHECK(separate_indexed(context.mesh, plane, out, context.cap, context.report));
+  CHECK(!context.cap.welds.empty());
+  triangulate_loops(plane, out.cap_upper, out.cap_lower, context.cap, 1, context.report);
+  add_cap(out);
+  CHECK(context.report.cap_facets > 0);
+  CHECK(open_edges(out.upper) == 0);
+  CHECK(open_edges(out.lower) == 0);
+}
+
+// a plane missing the mesh leaves nothing of the previous cut in a reused context
+void test_missing_plane_after_welds() {
+  std::vector<stl_facet> facets = torus(35);
+  stl_cut_context context(1);
+  cut_facets(context, &facets[0], facets.size(), stl_plane(0, 0, 1, 0));
+  CHECK(!context.cap.welds.empty());
+  cut_facets(context, &facets[0], facets.size(), stl_plane(0, 0, 1, -100));
+  CHECK(context.cap.welds.empty());
+  CHECK(context.cap.loops.size() == 0);
+  CHECK(context.separated.upper.empty());
+  CHECK(context.separated.lower.size() == facets.size());
+}
+
+// facets parallel to the index plane don't make every other facet long
+// the tube gets its flat rings twice, so most facets are flat
+void test_index_with_flat_facets() {
+  std::vector<stl_facet> facets = tube(false);
+  size_t count = facets.size();
+  for (size_t i = 0; i < count; i++)
+    if (facets[i].vertex[0].z == facets[i].vertex[1].z && facets[i].vertex[1].z == facets[i].vertex[2].z)
+      facets.push_back(facets[i]);
+  stl_cut_index index(&facets[0], facets.size(), stl_plane(0, 0, 1, 0));
+  CHECK(index.long_facets.empty());
+  CHECK(index.facets.size() == facets.size());
+}
+
+// the cap of a loop with a hole comes out closed whichever loop is stitched first
+void test_hole_before_outer_loop() {
+  for (int holes_first = 0; holes_first < 2; holes_first++) {
+    std::vector<stl_facet> facets = tube(holes_first);
+    stl_cut_context context(2);
+    cut_facets(context, &facets[0], facets.size(), stl_plane(0, 0, 1, 0));
+    CHECK(context.report.loops == 2);
+    CHECK(open_edges(context.separated.upper) == 0);
+    CHECK(open_edges(context.separated.lower) == 0);
+    CHECK(context.report.cap_facets == 128);
+  }
+}
+
+// the second cut of a mesh takes all memory from the buffers of the first one
+// the cap triangulation is left out, poly2tri allocates on its own
+void test_warm_cut_doesnt_allocate() {
+  std::vector<stl_facet> facets = tube(false);
+  stl_cut_context context(1);
+  stl_plane plane(0, 0, 1, 0);
+  long allocated = 0;
+  for (int round = 0; round < 2; round++) {
+    long before = allocations;
+    context.clear();
+    stl_separated &out = context.separated;
+    separate_all(stl_facet_array(&facets[0]), facets.size(), plane, 1, out, context.parts);
+    stitch_border(out.border, plane, context.cap, context.report);
+    nest_loops(context.cap.loops, context.cap);
+    weld_seam(out, context.cap);
+    allocated = allocations - before;
+  }
+  CHECK(allocated == 0);
+}
+
+// the formatted float reads back bit for bit, by the ASCII parser and by strtof()
+bool round_trips(float value) {
+  char text[64];
+  char* end = format_float(value, text);
+  *end = '\0';
+  float parsed, read = strtof(text, NULL);
+  stl_ascii_parser parser(text, end);
+  if (!parser.number(parsed) || parser.p != end) return false;
+  if (value != value) return parsed != parsed && read != read;
+  return !memcmp(&parsed, &value, sizeof(float)) && !memcmp(&read, &value, sizeof(float));
+}
+
+// edge values, the neighbours of the powers of ten and a sweep over the bit patterns
+void test_format_float_round_trip() {
+  const float edges[] = { 0.0f, -0.0f, 1.0f, -1.0f, 0.1f, 0.3f, 16777216.0f, 16777215.0f,
+                          FLT_MIN, -FLT_MIN, FLT_MAX, -FLT_MAX, FLT_EPSILON, 1 + FLT_EPSILON,
+                          nextafterf(0.0f, 1.0f), nextafterf(FLT_MIN, 0.0f), HUGE_VALF, -HUGE_VALF, NAN };
+  for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++)
+    CHECK(round_trips(edges[i]));
+  
+  int failed = 0;
+  for (int e = -45; e <= 38; e++) {
+    float power = strtof(("1e" + std::to_string(e)).c_str(), NULL);
+    float values[] = { power, nextafterf(power, 0.0f), nextafterf(power, HUGE_VALF), 5 * power, 9.999999f * power };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+      if (!round_trips(values[i]) || !round_trips(-values[i])) failed++;
+  }
+  for (unsigned long long bits = 0; bits <= 0xffffffffULL; bits += 65521) {
+    unsigned pattern = bits;
+    float value;
+    memcpy(&value, &pattern, sizeof(float));
+    if (!round_trips(value)) failed++;
+  }
+  CHECK(failed == 0);
+}
+
+// writes the facet in one of the number styles and line ends of different exporters
+void write_ascii_facet(FILE* fp, const stl_facet &facet, int style) {
+  static const char* formats[] = { "%g", "%.9e", "%+.6f", "%.9E" };
+  static const char* spaces[] = { " ", "\t", "  ", " \t " };
+  static const char* ends[] = { "\n", "\r\n", " \n", "\n\n" };
+  const char* format = formats[style % 4];
+  const char* space = spaces[style / 4 % 4];
+  const char* end = ends[style / 16 % 4];
+  const float* values = &facet.normal.x;
+  fprintf(fp, "%sfacet%snormal", space, space);
+  for (size_t i = 0; i < 12; i++) {
+    if (i == 3) fprintf(fp, "%s%souter loop", end, space);
+    if (i % 3 == 0 && i) fprintf(fp, "%s%svertex", end, space);
+    fprintf(fp, "%s", space);
+    fprintf(fp, format, values[i]);
+  }
+  fprintf(fp, "%s%sendloop%s%sendfacet%s", end, space, end, space, end);
+}
+
+// the multithreaded parser of mapped ASCII files reads what the fscanf() stream reader reads
+void test_ascii_parser() {
+  char name[] = "/tmp/stlcut_test.XXXXXX";
+  int fd = mkstemp(name);
+  CHECK(fd >= 0);
+  if (fd < 0) return;
+  FILE* fp = fdopen(fd, "w");
+  fprintf(fp, "solid test\n");
+  // enough text for more parsing threads
+  const int count = 100000;
+  unsigned random = 12345;
+  for (int i = 0; i < count; i++) {
+    stl_facet facet = make_facet(make_vertex(0, 0, 0), make_vertex(0, 0, 0), make_vertex(0, 0, 0));
+    float* values = &facet.normal.x;
+    for (size_t j = 0; j < 12; j++) {
+      random = random * 1103515245 + 12345;
+      values[j] = ((int)(random >> 8) % 2000000 - 1000000) / (float)(1 << (random % 24));
+    }
+    write_ascii_facet(fp, facet, i % 64);
+  }
+  fprintf(fp, "endsolid test\n");
+  fclose(fp);
+  
+  stl_input input;
+  CHECK(input.map_ascii(name, 4));
+  CHECK(input.number_of_facets == count);
+  stl_reader reader;
+  CHECK(reader.open(name));
+  std::vector<stl_facet> expected(count + 1);
+  CHECK(reader.read(&expected[0], expected.size()) == count);
+  CHECK(!reader.error);
+  reader.close();
+  int different = 0;
+  for (int i = 0; i < input.number_of_facets && i < count; i++) {
+    stl_facet facet = input.facet(i);
+    if (memcmp(&facet, &expected[i], SIZEOF_STL_FACET)) different++;
+  }
+  CHECK(different == 0);
+  input.close();
+  unlink(name);
+}
+
+// little endian field of a zip file
+unsigned zip_field(const std::string &zip, size_t offset, size_t bytes) {
+  unsigned value = 0;
+  for (size_t i = 0; i < bytes && offset + i < zip.size(); i++)
+    value |= (unsigned)(unsigned char)zip[offset + i] << 8*i;
+  return value;
+}
+
+// CRC-32 computed bit by bit, apart from the table of stl_zip
+unsigned slow_crc32(const char* data, size_t size) {
+  unsigned crc = 0xffffffffU;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= (unsigned char)data[i];
+    for (size_t k = 0; k < 8; k++)
+      crc = crc & 1 ? 0xedb88320U ^ (crc >> 1) : crc >> 1;
+  }
+  return crc ^ 0xffffffffU;
+}
+
+// every entry of a written 3MF has the CRC of its data in the local header and the central directory
+void test_3mf_crc() {
+  CHECK(stl_zip::crc32("123456789") == 0xcbf43926U);
+  
+  // tetrahedron
+  stl_indexed_part part;
+  part.vertices.push_back(make_vertex(0, 0, 0));
+  part.vertices.push_back(make_vertex(1, 0, 0));
+  part.vertices.push_back(make_vertex(0, 1, 0));
+  part.vertices.push_back(make_vertex(0, 0, 1));
+  const int indices[] = { 0, 2, 1, 0, 1, 3, 0, 3, 2, 1, 2, 3 };
+  part.indices.assign(indices, indices + 12);
+  
+  FILE* fp = tmpfile();
+  CHECK(fp != NULL);
+  if (!fp) return;
+  bool ok = true;
+  write_3mf(fp, part, ok);
+  CHECK(ok);
+  std::string zip;
+  zip.resize(ftell(fp));
+  rewind(fp);
+  CHECK(fread(&zip[0], 1, zip.size(), fp) == zip.size());
+  fclose(fp);
+  
+  size_t end = zip.size() - 22;
+  CHECK(zip.size() > 22 && zip_field(zip, end, 4) == 0x06054b50);
+  unsigned entries = zip_field(zip, end + 10, 2);
+  CHECK(entries == 3);
+  size_t central = zip_field(zip, end + 16, 4);
+  bool model = false;
+  for (unsigned e = 0; e < entries && central + 46 <= end; e++) {
+    CHECK(zip_field(zip, central, 4) == 0x02014b50);
+    unsigned crc = zip_field(zip, central + 16, 4);
+    unsigned size = zip_field(zip, central + 24, 4);
+    unsigned name_size = zip_field(zip, central + 28, 2);
+    size_t local = zip_field(zip, central + 42, 4);
+    std::string name = zip.substr(central + 46, name_size);
+    if (name == "3D/3dmodel.model") model = true;
+    
+    CHECK(zip_field(zip, local, 4) == 0x04034b50);
+    CHECK(zip_field(zip, local + 8, 2) == 0); // stored
+    CHECK(zip_field(zip, local + 14, 4) == crc);
+    CHECK(zip_field(zip, local + 18, 4) == size && zip_field(zip, local + 22, 4) == size);
+    size_t data = local + 30 + zip_field(zip, local + 26, 2) + zip_field(zip, local + 28, 2);
+    CHECK(data + size <= zip.size());
+    if (data + size <= zip.size()) CHECK(slow_crc32(&zip[data], size) == crc);
+    central += 46 + name_size + zip_field(zip, central + 30, 2) + zip_field(zip, central + 32, 2);
+  }
+  CHECK(model);
+}
+
+// data of a stored entry of a zip file, empty if there's no such entry
+std::string zip_entry(const std::string &zip, const std::string &name) {
+  if (zip.size() < 22) return "";
+  size_t end = zip.size() - 22;
+  size_t central = zip_field(zip, end + 16, 4);
+  for (unsigned e = 0; e < zip_field(zip, end + 10, 2) && central + 46 <= end; e++) {
+    unsigned size = zip_field(zip, central + 24, 4);
+    unsigned name_size = zip_field(zip, central + 28, 2);
+    size_t local = zip_field(zip, central + 42, 4);
+    if (zip.compare(central + 46, name_size, name) == 0) {
+      size_t data = local + 30 + zip_field(zip, local + 26, 2) + zip_field(zip, local + 28, 2);
+      return data + size <= zip.size() ? zip.substr(data, size) : "";
+    }
+    central += 46 + name_size + zip_field(zip, central + 30, 2) + zip_field(zip, central + 32, 2);
+  }
+  return "";
+}
+
+// a 3MF written from a real cut is a closed mesh by index,
+// every edge of a part is there once and so is its opposite edge
+void test_3mf_of_cut_is_closed() {
+  std::vector<stl_facet> facets = torus(35);
+  stl_cut_context context(1);
+  stl_plane plane(0, 0, 1, 0);
+  index_facets(stl_facet_array(&facets[0]), facets.size(), context.mesh, context.indexed.table);
+  stl_indexed_cut &out = context.indexed;
+  CHECK(separate_indexed(context.mesh, plane, out, context.cap, context.report));
+  triangulate_loops(plane, out.cap_upper, out.cap_lower, context.cap, 1, context.report);
+  add_cap(out);
+  
+  for (size_t k = 0; k < 2; k++) {
+    char name[] = "/tmp/stlcut_test.XXXXXX";
+    int fd = mkstemp(name);
+    CHECK(fd >= 0);
+    if (fd < 0) return;
+    close(fd);
+    stl_indexed_part part;
+    CHECK(export_indexed(out, k ? out.lower : out.upper, name, format_3mf, false, part, context.report));
+    FILE* fp = fopen(name, "rb");
+    std::string zip;
+    char buffer[65536];
+    for (size_t read; fp && (read = fread(buffer, 1, sizeof(buffer), fp)) > 0; )
+      zip.append(buffer, read);
+    if (fp) fclose(fp);
+    unlink(name);
+    
+    std::string model = zip_entry(zip, "3D/3dmodel.model");
+    std::unordered_map<unsigned long long, int> edges;
+    size_t triangles = 0;
+    for (size_t at = model.find("<triangle "); at != std::string::npos; at = model.find("<triangle ", at + 1)) {
+      unsigned v[3];
+      CHECK(sscanf(model.c_str() + at, "<triangle v1=\"%u\" v2=\"%u\" v3=\"%u\"", &v[0], &v[1], &v[2]) == 3);
+      for (size_t j = 0; j < 3; j++)
+        edges[(unsigned long long)v[j] << 32 | v[(j+1)%3]]++;
+      triangles++;
+    }
+    CHECK(triangles == (k ? out.lower : out.upper).size());
+    size_t bad = 0;
+    for (std::unordered_map<unsigned long long, int>::iterator e = edges.begin(); e != edges.end(); e++) {
+      std::unordered_map<unsigned long long, int>::iterator back = edges.find(e->first << 32 | e->first >> 32);
+      if (e->second != 1 || back == edges.end() || back->second != 1) bad++;
+    }
+    CHECK(triangles > 0 && bad == 0);
+  }
+}
+
+int main() {
+  test_hole_before_outer_loop();
+  test_warm_cut_doesnt_allocate();
+  test_indexed_cut_is_closed();
+  test_missing_plane_after_welds();
+  test_index_with_flat_facets();
+  test_format_float_round_trip();
+  test_ascii_parser();
+  test_3mf_crc();
+  test_3mf_of_cut_is_closed();
+  if (failures) fprintf(stderr, "%d checks failed\n", failures);
+  return failures ? 1 : 0;
+}